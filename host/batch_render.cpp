@@ -0,0 +1,471 @@
+/*
+ * Renders many looper sessions at once, for regression runs and A/B comparisons of engine changes.
+ *
+ * A session is a footswitch script run through the looper engine (src/looper.cpp). Each one gets
+ * its own looper context and PSRAM stand-in, so the sessions are spread over a work-stealing
+ * thread pool: every worker starts with an equal share and, once it runs out, takes sessions from
+ * the front of another worker's queue. Each session runs start to finish on one thread, because the
+ * engine's context, clock and PSRAM are per thread (see host_pico.h).
+ *
+ * With --out the output of every session is saved as a WAV; with --ref each output is compared
+ * against the WAV of the same name from an earlier run (say, with the engine before a change). The
+ * summary has the render times, how well the pool scaled and which sessions came out different.
+ *
+ * A script is one command per line, times in seconds, tracks by number:
+ *
+ *   seconds 30             how long to render
+ *   input take.wav         the input (16 bit, 48 kHz, the left channel if stereo), relative to the
+ *                          script. Without one the input is a tone
+ *   tone 220 8000          frequency and amplitude of the tone. It's silent until the first press
+ *   tap 0.5 0              a short press of track 0's footswitch
+ *   press 3.0 1            track 1's footswitch goes down...
+ *   release 3.8 1          ...and back up
+ *   gain 6.0 0 main 0.5    a layer gain (main or active) as a fraction of full level
+ *   rate 8.0 -1.0          the playback rate of every track
+ *
+ * --generate DIR N writes N random scripts to start from.
+ *
+ * usage: batch_render [--jobs N] [--out DIR] [--ref DIR] [--list] SCRIPT|DIR...
+ *        batch_render --generate DIR N [--seed N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pico/stdlib.h"
+
+#include "auto_looper.h"
+#include "host_pico.h"
+#include "wav_transfer.h"
+
+#define SAMPLE_RATE 48000
+#define TAP_US 50000 // how long the footswitch is held down for a tap
+
+namespace fs = std::filesystem;
+using std::string;
+using std::vector;
+using bench_clock = std::chrono::steady_clock;
+
+enum event_type_t { EVENT_PRESS, EVENT_RELEASE, EVENT_GAIN, EVENT_RATE };
+
+struct event_t {
+    uint64_t sample;
+    event_type_t type;
+    uint track;
+    uint layer;
+    double value;
+};
+
+struct session_t {
+    string name;
+    string path;
+    uint64_t samples = 0;
+    vector<int16_t> input; // empty: the tone
+    double tone_hz = 220;
+    double tone_level = 8000;
+    vector<event_t> events;
+    string error;
+};
+
+struct result_t {
+    double render_seconds = 0; // CPU time of the thread that rendered it
+    uint worker = 0;
+    bool stolen = false;
+    vector<int16_t> output;
+    bool has_reference = false;
+    uint64_t differences = 0; // samples that aren't the same as the reference
+    int32_t largest_difference = 0;
+    uint64_t first_difference = 0;
+    string error;
+};
+
+static bool read_wav(const string& path, vector<int16_t>* samples, string* error) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        *error = "can't open " + path;
+        return false;
+    }
+    uint8_t header[WAV_HEADER_SIZE];
+    wav_format_t format;
+    bool ok = fread(header, 1, WAV_HEADER_SIZE, f) == WAV_HEADER_SIZE && wav_parse_header(header, &format) &&
+              format.bits == 16 && format.sample_rate == SAMPLE_RATE && (format.channels == 1 || format.channels == 2);
+    if (!ok) {
+        *error = path + " isn't a 16 bit, 48 kHz WAV";
+        fclose(f);
+        return false;
+    }
+    vector<int16_t> data(format.data_size / 2);
+    data.resize(fread(data.data(), 2, data.size(), f));
+    fclose(f);
+    samples->clear();
+    for (size_t i = 0; i < data.size(); i += format.channels) samples->push_back(data[i]);
+    return true;
+}
+
+static bool write_wav(const string& path, const vector<int16_t>& samples) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) return false;
+    uint8_t header[WAV_HEADER_SIZE];
+    wav_format_t format = {1, 16, SAMPLE_RATE, (uint32_t) (samples.size() * 2)};
+    wav_write_header(header, format);
+    fwrite(header, 1, WAV_HEADER_SIZE, f);
+    fwrite(samples.data(), 2, samples.size(), f);
+    fclose(f);
+    return true;
+}
+
+// CPU time, so a session's time doesn't include the time its thread spent waiting for a core
+static double thread_seconds() {
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static uint64_t to_sample(double seconds) {
+    return seconds > 0 ? (uint64_t) (seconds * SAMPLE_RATE) : 0;
+}
+
+static bool parse_script(session_t* session) {
+    FILE* f = fopen(session->path.c_str(), "r");
+    if (!f) {
+        session->error = "can't open the script";
+        return false;
+    }
+    char line[256];
+    uint line_number = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_number++;
+        char command[32] = "", word[128] = "";
+        double time = 0, value = 0;
+        uint track = 0;
+        if (sscanf(line, "%31s", command) != 1 || command[0] == '#') continue;
+
+        bool ok = true;
+        if (!strcmp(command, "seconds")) {
+            ok = sscanf(line, "%*s %lf", &time) == 1;
+            session->samples = to_sample(time);
+        } else if (!strcmp(command, "input")) {
+            ok = sscanf(line, "%*s %127s", word) == 1;
+            string path = (fs::path(session->path).parent_path() / word).string();
+            if (ok && !read_wav(path, &session->input, &session->error)) break;
+        } else if (!strcmp(command, "tone")) {
+            ok = sscanf(line, "%*s %lf %lf", &session->tone_hz, &session->tone_level) == 2;
+        } else if (!strcmp(command, "tap") || !strcmp(command, "press") || !strcmp(command, "release")) {
+            ok = sscanf(line, "%*s %lf %u", &time, &track) == 2 && track < NUM_TRACKS;
+            uint64_t at = to_sample(time);
+            if (strcmp(command, "release")) session->events.push_back({at, EVENT_PRESS, track, 0, 0});
+            if (!strcmp(command, "tap")) at += to_sample(TAP_US / 1e6);
+            if (strcmp(command, "press")) session->events.push_back({at, EVENT_RELEASE, track, 0, 0});
+        } else if (!strcmp(command, "gain")) {
+            ok = sscanf(line, "%*s %lf %u %127s %lf", &time, &track, word, &value) == 4 && track < NUM_TRACKS &&
+                 (!strcmp(word, "main") || !strcmp(word, "active"));
+            uint layer = strcmp(word, "main") ? ACTIVE_SAMPLE : MAIN_SAMPLE;
+            session->events.push_back({to_sample(time), EVENT_GAIN, track, layer, value});
+        } else if (!strcmp(command, "rate")) {
+            ok = sscanf(line, "%*s %lf %lf", &time, &value) == 2;
+            session->events.push_back({to_sample(time), EVENT_RATE, 0, 0, value});
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            session->error = "can't read line " + std::to_string(line_number);
+            break;
+        }
+    }
+    fclose(f);
+    if (session->error.empty() && session->samples == 0) session->error = "no `seconds`";
+    std::stable_sort(session->events.begin(), session->events.end(),
+                     [](const event_t& a, const event_t& b) { return a.sample < b.sample; });
+    return session->error.empty();
+}
+
+/**
+ * Run one session through a fresh looper context. `psram` belongs to the worker and is reused
+ * between its sessions without being cleared: a new context's silence maps say every block is
+ * silent, so nothing a previous session left in PSRAM is ever read back.
+*/
+static void render(const session_t& session, uint8_t* psram, result_t* result) {
+    std::unique_ptr<looper_context_t> context(new looper_context_t());
+    looper_ctx = context.get();
+    host_psram_use(psram);
+    host_time_us = 0;
+    for (uint i = 0; i < NUM_TRACKS; i++) {
+        looper_ctx->tracks[i].id = i;
+        looper_ctx->tracks[i].psram_base = psram_partition(i);
+    }
+
+    uint64_t first_press = UINT64_MAX;
+    for (const event_t& event : session.events) {
+        if (event.type == EVENT_PRESS) first_press = std::min(first_press, event.sample);
+    }
+
+    result->output.resize(session.samples);
+    size_t next_event = 0;
+    double start = thread_seconds();
+    for (uint64_t n = 0; n < session.samples; n++) {
+        host_time_us = n * 1000000 / SAMPLE_RATE;
+        for (; next_event < session.events.size() && session.events[next_event].sample <= n; next_event++) {
+            const event_t& event = session.events[next_event];
+            track_t& t = looper_ctx->tracks[event.track];
+            if (event.type == EVENT_PRESS || event.type == EVENT_RELEASE) footswitch_changed(t, event.type == EVENT_RELEASE);
+            else if (event.type == EVENT_GAIN) set_layer_gain(t, event.layer, (int32_t) lround(event.value * GAIN_UNITY));
+            else set_playback_rate((int) lround(event.value * PLAYBACK_RATE_UNITY));
+        }
+
+        int16_t input;
+        if (!session.input.empty()) {
+            input = n < session.input.size() ? session.input[n] : 0;
+        } else {
+            input = n < first_press ? 0 : (int16_t) (session.tone_level * sin(2 * M_PI * session.tone_hz * n / SAMPLE_RATE));
+        }
+        result->output[n] = get_next_sample(input);
+        if (looper_ctx->signal_write) service_tracks();
+    }
+    result->render_seconds = thread_seconds() - start;
+
+    looper_ctx = nullptr;
+    host_psram_use(nullptr);
+}
+
+static void compare(const vector<int16_t>& reference, result_t* result) {
+    result->has_reference = true;
+    size_t length = std::max(reference.size(), result->output.size());
+    for (size_t i = 0; i < length; i++) {
+        int32_t a = i < reference.size() ? reference[i] : INT32_MIN;
+        int32_t b = i < result->output.size() ? result->output[i] : INT32_MIN;
+        if (a == b) continue;
+        if (result->differences == 0) result->first_difference = i;
+        result->differences++;
+        // past the end of either one counts as the largest possible difference
+        int32_t difference = a == INT32_MIN || b == INT32_MIN ? 65535 : abs(a - b);
+        if (difference > result->largest_difference) result->largest_difference = difference;
+    }
+}
+
+// one worker's queue of session indices. The owner takes from the back, thieves from the front
+struct work_queue_t {
+    std::mutex lock;
+    std::deque<size_t> jobs;
+    uint32_t steals = 0;
+
+    bool pop_back(size_t* job) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (jobs.empty()) return false;
+        *job = jobs.back();
+        jobs.pop_back();
+        return true;
+    }
+
+    bool steal(size_t* job) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (jobs.empty()) return false;
+        *job = jobs.front();
+        jobs.pop_front();
+        return true;
+    }
+};
+
+static void worker(uint id, vector<work_queue_t>& queues, const vector<session_t>& sessions, vector<result_t>& results,
+                   const string& out_dir, const string& ref_dir) {
+    vector<uint8_t> psram(PSRAM_SIZE_BYTES);
+    uint count = queues.size();
+    while (true) {
+        size_t job;
+        bool stolen = false;
+        if (!queues[id].pop_back(&job)) {
+            // nothing new is ever queued, so once every queue is empty the work is done
+            bool found = false;
+            for (uint i = 1; i < count && !found; i++) found = queues[(id + i) % count].steal(&job);
+            if (!found) return;
+            stolen = true;
+            queues[id].steals++;
+        }
+
+        const session_t& session = sessions[job];
+        result_t& result = results[job];
+        result.worker = id;
+        result.stolen = stolen;
+        if (!session.error.empty()) {
+            result.error = session.error;
+            continue;
+        }
+        render(session, psram.data(), &result);
+
+        if (!out_dir.empty() && !write_wav((fs::path(out_dir) / (session.name + ".wav")).string(), result.output)) {
+            result.error = "can't write the output";
+        }
+        if (!ref_dir.empty()) {
+            vector<int16_t> reference;
+            string error;
+            string path = (fs::path(ref_dir) / (session.name + ".wav")).string();
+            if (fs::exists(path)) {
+                if (read_wav(path, &reference, &error)) compare(reference, &result);
+                else result.error = error;
+            }
+        }
+        result.output = vector<int16_t>(); // every session's output held at once would add up
+    }
+}
+
+static void add_scripts(const string& path, vector<session_t>* sessions) {
+    vector<string> paths;
+    if (fs::is_directory(path)) {
+        for (const auto& entry : fs::directory_iterator(path)) {
+            if (entry.path().extension() == ".script") paths.push_back(entry.path().string());
+        }
+        std::sort(paths.begin(), paths.end());
+    } else {
+        paths.push_back(path);
+    }
+    for (const string& p : paths) {
+        session_t session;
+        session.path = p;
+        session.name = fs::path(p).stem().string();
+        sessions->push_back(session);
+    }
+}
+
+// random sessions: a loop recorded on track 0, and maybe an overdub, a second track, gain and rate changes
+static int generate(const string& dir, uint count, uint seed) {
+    fs::create_directories(dir);
+    srand(seed);
+    auto random = [](double low, double high) { return low + (high - low) * rand() / RAND_MAX; };
+    for (uint i = 0; i < count; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "session%04u.script", i);
+        FILE* f = fopen((fs::path(dir) / name).string().c_str(), "w");
+        if (!f) {
+            perror(name);
+            return 1;
+        }
+        double start = random(0.2, 1), loop = random(1, 6);
+        double close = start + loop;
+        double end = close + random(4, 20);
+        fprintf(f, "# generated with --seed %u\n", seed);
+        fprintf(f, "seconds %.3f\n", end);
+        fprintf(f, "tone %.1f %.0f\n", random(80, 1000), random(1000, 20000));
+        fprintf(f, "tap %.3f 0\ntap %.3f 0\n", start, close);
+        if (rand() % 2) {
+            double overdub = close + random(1, 3);
+            fprintf(f, "tap %.3f 0\ntap %.3f 0\n", overdub, overdub + random(0.3, loop));
+        }
+        if (rand() % 2) {
+            double second = close + random(0.5, 2);
+            fprintf(f, "tap %.3f 1\ntap %.3f 1\n", second, second + loop * (1 + rand() % 2));
+        }
+        if (rand() % 2) fprintf(f, "gain %.3f 0 %s %.3f\n", random(close, end), rand() % 2 ? "main" : "active", random(0, 1));
+        if (rand() % 3 == 0) fprintf(f, "rate %.3f %.3f\n", random(close, end), random(-2, 2));
+        if (rand() % 4 == 0) fprintf(f, "press %.3f 0\nrelease %.3f 0\n", end - 2, end - 1); // a long press clears
+        fclose(f);
+    }
+    printf("wrote %u scripts to %s\n", count, dir.c_str());
+    return 0;
+}
+
+static int usage(const char* name) {
+    printf("usage: %s [--jobs N] [--out DIR] [--ref DIR] [--list] SCRIPT|DIR...\n", name);
+    printf("       %s --generate DIR N [--seed N]\n", name);
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    uint jobs = std::max(1u, std::thread::hardware_concurrency());
+    string out_dir, ref_dir, generate_dir;
+    uint generate_count = 0, seed = 1;
+    bool list = false;
+    vector<session_t> sessions;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--jobs") && i + 1 < argc) jobs = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--out") && i + 1 < argc) out_dir = argv[++i];
+        else if (!strcmp(argv[i], "--ref") && i + 1 < argc) ref_dir = argv[++i];
+        else if (!strcmp(argv[i], "--list")) list = true;
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc) seed = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--generate") && i + 2 < argc) {
+            generate_dir = argv[++i];
+            generate_count = atoi(argv[++i]);
+        } else if (argv[i][0] == '-') return usage(argv[0]);
+        else add_scripts(argv[i], &sessions);
+    }
+    if (!generate_dir.empty()) return generate(generate_dir, generate_count, seed);
+    if (sessions.empty()) return usage(argv[0]);
+    if (!out_dir.empty()) fs::create_directories(out_dir);
+
+    for (session_t& session : sessions) parse_script(&session);
+    uint64_t total_samples = 0;
+    for (const session_t& session : sessions) {
+        if (session.error.empty()) total_samples += session.samples;
+    }
+
+    // the engine's debug output from every worker at once would bury the summary
+    fflush(stdout);
+    FILE* report = fdopen(dup(fileno(stdout)), "w");
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+
+    vector<result_t> results(sessions.size());
+    vector<work_queue_t> queues(jobs);
+    for (size_t i = 0; i < sessions.size(); i++) queues[i % jobs].jobs.push_back(i);
+    auto start = bench_clock::now();
+    vector<std::thread> threads;
+    for (uint id = 0; id < jobs; id++) {
+        threads.emplace_back(worker, id, std::ref(queues), std::cref(sessions), std::ref(results), std::cref(out_dir),
+                             std::cref(ref_dir));
+    }
+    for (std::thread& thread : threads) thread.join();
+    double wall = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+    double render_total = 0, slowest = 0;
+    uint failed = 0, differ = 0, identical = 0, steals = 0;
+    for (size_t i = 0; i < sessions.size(); i++) {
+        const session_t& session = sessions[i];
+        const result_t& result = results[i];
+        render_total += result.render_seconds;
+        slowest = std::max(slowest, result.render_seconds);
+        bool bad = !result.error.empty() || result.differences > 0;
+        if (!result.error.empty()) failed++;
+        else if (result.differences > 0) differ++;
+        else if (result.has_reference) identical++;
+
+        if (!list && !bad) continue;
+        fprintf(report, "%-24s %8.1f s %9.1f ms %8.0fx  worker %2u%s  ", session.name.c_str(),
+                (double) session.samples / SAMPLE_RATE, result.render_seconds * 1000,
+                result.render_seconds > 0 ? session.samples / (double) SAMPLE_RATE / result.render_seconds : 0,
+                result.worker, result.stolen ? " (stolen)" : "         ");
+        if (!result.error.empty()) {
+            fprintf(report, "FAILED: %s\n", result.error.c_str());
+        } else if (result.differences > 0) {
+            fprintf(report, "DIFFERS: %llu samples, by up to %d, from %.3f s\n", (unsigned long long) result.differences,
+                    result.largest_difference, (double) result.first_difference / SAMPLE_RATE);
+        } else {
+            fprintf(report, "%s\n", result.has_reference ? "same" : "");
+        }
+    }
+    for (work_queue_t& queue : queues) steals += queue.steals;
+
+    double audio = (double) total_samples / SAMPLE_RATE;
+    fprintf(report, "\n%zu sessions, %.1f s of audio in %.2f s on %u threads: %.0fx real time\n", sessions.size(), audio,
+            wall, jobs, audio / wall);
+    fprintf(report, "render CPU time %.2f s summed over the sessions (slowest %.3f s): %.2fx speedup, %.0f%% of %u threads\n",
+            render_total, slowest, render_total / wall, 100 * render_total / wall / jobs, jobs);
+    fprintf(report, "%u sessions stolen between workers\n", steals);
+    if (!ref_dir.empty()) {
+        fprintf(report, "against %s: %u the same, %u different, %zu without a reference\n", ref_dir.c_str(), identical,
+                differ, sessions.size() - identical - differ - failed);
+    }
+    if (failed) fprintf(report, "%u sessions failed\n", failed);
+    fclose(report);
+    return failed || differ ? 1 : 0;
+}
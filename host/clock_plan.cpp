@@ -0,0 +1,264 @@
+/*
+ * Works out the idle system clock for the firmware's I2S setup, and checks the sequence that
+ * switches between it and the full clock (src/sys_clock.h).
+ *
+ * First it goes through the integer clk_sys dividers of the full clock with the same divider math
+ * the firmware uses (src/i2s_clocks.h) and shows which ones keep the I2S dividers exact, and which
+ * one the firmware picks. For reference it also lists the exact clocks the PLL could make, which
+ * would need a relock.
+ *
+ * Then it simulates the PIO clock dividers (free running 16.8 fractional dividers, like the
+ * hardware) through a switch in both directions, at many different points in the I2S frame, for
+ * a few ways of ordering the register writes. For each it reports how far BCK/LRCK slip against
+ * SCK (in SCK cycles, the codecs want them locked) and how much the audio clock stretches.
+ *
+ * usage: clock_plan [--full-khz N] [--min-khz N] [--switches N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "sys_clock.h"
+
+#define FS 48000       // the I2S config in main()
+#define SCK_MULT 256
+#define BIT_DEPTH 16
+#define WRITE_CYCLES 3 // sys clocks per peripheral register write, with the instructions around it
+
+// the SMs i2s.cpp sets up in sync mode: two SCK outputs, the input (clocked with SCK) and the output
+enum { SM_SCK0, SM_SCK1, SM_DIN, SM_DOUT, NUM_SMS };
+
+struct pio_sim_t {
+    uint32_t div[NUM_SMS]; // 16.8 fixed point
+    uint32_t acc[NUM_SMS] = {};
+    uint64_t executed[NUM_SMS] = {};
+    bool enabled = true;
+
+    double now_ns = 0;
+    double sys_ns; // clk_sys period
+    uint32_t ratio; // SCK PIO ticks per BCK PIO tick
+
+    // SCK ticks minus `ratio` BCK ticks, sampled at BCK ticks: constant while they are locked
+    std::vector<int64_t> phase;
+
+    void set_clocks(uint32_t sys_hz, const pio_i2s_clocks& clocks) {
+        sys_ns = 1e9 / sys_hz;
+        for (int sm = 0; sm < NUM_SMS; sm++) set_div(sm, clocks);
+    }
+
+    void set_div(int sm, const pio_i2s_clocks& clocks) {
+        div[sm] = sm == SM_DOUT ? clocks.bck_d * 256 + clocks.bck_f : clocks.sck_d * 256 + clocks.sck_f;
+    }
+
+    void restart() {
+        for (uint32_t& a : acc) a = 0;
+    }
+
+    void cycle() {
+        bool bck_tick = false;
+        for (int sm = 0; sm < NUM_SMS; sm++) {
+            acc[sm] += 256;
+            if (acc[sm] < div[sm]) continue;
+            acc[sm] -= div[sm];
+            if (!enabled) continue;
+            executed[sm]++;
+            if (sm == SM_DOUT) bck_tick = true;
+        }
+        if (bck_tick) phase.push_back((int64_t) executed[SM_SCK0] - (int64_t) ratio * executed[SM_DOUT]);
+        now_ns += sys_ns;
+    }
+
+    void run(uint64_t cycles) {
+        for (uint64_t i = 0; i < cycles; i++) cycle();
+    }
+};
+
+enum op_t { OP_DISABLE, OP_SYS_DIV, OP_SM_DIVS, OP_ENABLE, OP_ENABLE_SYNC };
+
+struct strategy_t {
+    const char* name;
+    std::vector<op_t> ops;
+    bool fast_writes = false; // move OP_SYS_DIV so the other writes all happen at the fast clock
+};
+
+struct result_t {
+    int64_t max_slip = 0;     // SCK PIO ticks
+    double max_stretch_ns = 0;
+    bool locked = true;       // BCK ticks don't wander against SCK any more after the switch than before
+};
+
+static void run_switch(const strategy_t& strategy, uint32_t from_hz, const pio_i2s_clocks& from,
+                       uint32_t to_hz, const pio_i2s_clocks& to, uint64_t lead_cycles, result_t* result) {
+    pio_sim_t pio;
+    pio.ratio = (to.bck_d * 256 + to.bck_f) / (to.sck_d * 256 + to.sck_f);
+    pio.set_clocks(from_hz, from);
+    pio.restart();
+    pio.run(lead_cycles);
+
+    int64_t before_min = INT64_MAX, before_max = INT64_MIN;
+    for (int64_t phase : pio.phase) {
+        before_min = std::min(before_min, phase);
+        before_max = std::max(before_max, phase);
+    }
+    size_t switch_index = pio.phase.size();
+
+    std::vector<op_t> ops = strategy.ops;
+    if (strategy.fast_writes) {
+        ops.erase(std::find(ops.begin(), ops.end(), OP_SYS_DIV));
+        bool up = to_hz > from_hz;
+        ops.insert(up ? ops.begin() + 1 : ops.end() - 1, OP_SYS_DIV);
+    }
+    for (op_t op : ops) {
+        pio.run(WRITE_CYCLES);
+        switch (op) {
+        case OP_DISABLE: pio.enabled = false; break;
+        case OP_SYS_DIV: pio.sys_ns = 1e9 / to_hz; break;
+        case OP_SM_DIVS:
+            // one register write per SM, in SM order
+            for (int sm = 0; sm < NUM_SMS; sm++) {
+                pio.set_div(sm, to);
+                if (sm + 1 < NUM_SMS) pio.run(WRITE_CYCLES);
+            }
+            break;
+        case OP_ENABLE: pio.enabled = true; break;
+        case OP_ENABLE_SYNC: pio.enabled = true; pio.restart(); break;
+        }
+    }
+    pio.run(20 * (to.bck_d + 1) * 64); // a couple of frames
+
+    // the ticks right around the switch can land either side of it, so they don't count
+    int64_t after_min = INT64_MAX, after_max = INT64_MIN;
+    for (size_t i = switch_index + 2; i < pio.phase.size(); i++) {
+        after_min = std::min(after_min, pio.phase[i]);
+        after_max = std::max(after_max, pio.phase[i]);
+    }
+    int64_t slip = std::max(std::max(before_min - after_min, after_max - before_max), (int64_t) 0);
+    result->max_slip = std::max(result->max_slip, slip);
+    if (after_max - after_min > before_max - before_min) result->locked = false;
+
+    // how far the BCK ticks that came out lag behind a clock that never stopped
+    double bck_ns = 1e9 / ((double) FS * BIT_DEPTH * 2 * I2S_BCK_PIO_MULT);
+    double stretch = pio.now_ns - pio.executed[SM_DOUT] * bck_ns;
+    if (stretch > result->max_stretch_ns) result->max_stretch_ns = stretch;
+}
+
+static bool pll_reachable(uint32_t khz) {
+    // the search check_sys_clock_khz() does in the SDK
+    for (uint32_t fbdiv = 320; fbdiv >= 16; fbdiv--) {
+        uint32_t vco_khz = fbdiv * 12000;
+        if (vco_khz < 750000 || vco_khz > 1600000) continue;
+        for (uint32_t pd1 = 7; pd1 >= 1; pd1--) {
+            for (uint32_t pd2 = pd1; pd2 >= 1; pd2--) {
+                if (vco_khz == khz * pd1 * pd2) return true;
+            }
+        }
+    }
+    return false;
+}
+
+int main(int argc, char** argv) {
+    uint32_t full_hz = 132000000;
+    uint32_t min_hz = SYS_CLOCK_IDLE_MIN_HZ;
+    uint32_t switches = 2000;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--full-khz") && i + 1 < argc) full_hz = atoi(argv[++i]) * 1000;
+        else if (!strcmp(argv[i], "--min-khz") && i + 1 < argc) min_hz = atoi(argv[++i]) * 1000;
+        else if (!strcmp(argv[i], "--switches") && i + 1 < argc) switches = atoi(argv[++i]);
+        else {
+            printf("usage: %s [--full-khz N] [--min-khz N] [--switches N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("I2S: fs %d, SCK %dx fs, %d bit, full clk_sys %.3f MHz, idle floor %.3f MHz\n\n",
+           FS, SCK_MULT, BIT_DEPTH, full_hz / 1e6, min_hz / 1e6);
+
+    pio_i2s_clocks full;
+    i2s_calc_clocks(full_hz, FS, SCK_MULT, BIT_DEPTH, &full);
+    bool full_exact = i2s_clocks_exact(full_hz, FS, SCK_MULT, BIT_DEPTH, &full);
+
+    pio_i2s_clocks idle;
+    uint32_t idle_div = sys_clock_idle_divider(full_hz, min_hz, FS, SCK_MULT, BIT_DEPTH, &idle);
+    uint32_t idle_hz = full_hz / idle_div;
+
+    printf("%8s %12s %14s %14s %8s %18s\n", "divider", "clk_sys MHz", "SCK divider", "BCK divider", "exact", "PIO edge jitter");
+    for (uint32_t div = 1; div <= SYS_CLOCK_MAX_DIV; div++) {
+        if (full_hz % div != 0) continue;
+        uint32_t hz = full_hz / div;
+        pio_i2s_clocks clocks;
+        i2s_calc_clocks(hz, FS, SCK_MULT, BIT_DEPTH, &clocks);
+        bool exact = i2s_clocks_exact(hz, FS, SCK_MULT, BIT_DEPTH, &clocks);
+        // a fractional PIO divider moves edges by up to one clk_sys period
+        double jitter = clocks.sck_f || clocks.bck_f ? 1e9 / hz : 0;
+        printf("%8u %12.3f %9u+%3u/256 %9u+%3u/256 %8s %15.1f ns%s%s\n", div, hz / 1e6, clocks.sck_d, clocks.sck_f,
+               clocks.bck_d, clocks.bck_f, exact ? "yes" : "no", jitter, hz < min_hz ? "  (under the floor)" : "",
+               div == idle_div && div > 1 ? "  <- idle clock" : "");
+    }
+
+    printf("\nexact clocks the PLL could make between the floor and the full clock (each needs a relock):\n ");
+    int listed = 0;
+    for (uint32_t khz = min_hz / 1000; khz <= full_hz / 1000; khz++) {
+        pio_i2s_clocks clocks;
+        i2s_calc_clocks(khz * 1000, FS, SCK_MULT, BIT_DEPTH, &clocks);
+        if (!i2s_clocks_exact(khz * 1000, FS, SCK_MULT, BIT_DEPTH, &clocks) || !pll_reachable(khz)) continue;
+        printf(" %.3f", khz / 1000.0);
+        listed++;
+    }
+    printf("%s MHz\n\n", listed ? "" : " none");
+
+    if (!full_exact) {
+        printf("the full clock doesn't give exact I2S dividers\nFAIL\n");
+        return 1;
+    }
+    if (idle_div == 1) {
+        printf("no integer divider of the full clock keeps the I2S exact, the clock stays up\nPASS\n");
+        return 0;
+    }
+    printf("idle clock: %.3f MHz (clk_sys divider %u), %.0f%% of the full clock\n\n", idle_hz / 1e6, idle_div,
+           100.0 * idle_hz / full_hz);
+
+    strategy_t strategies[] = {
+        {"SMs running: clk_sys, then PIO dividers", {OP_SYS_DIV, OP_SM_DIVS}},
+        {"SMs running: PIO dividers, then clk_sys", {OP_SM_DIVS, OP_SYS_DIV}},
+        {"SMs paused, re-enabled", {OP_DISABLE, OP_SYS_DIV, OP_SM_DIVS, OP_ENABLE}},
+        {"SMs paused, re-enabled with divider restart", {OP_DISABLE, OP_SYS_DIV, OP_SM_DIVS, OP_ENABLE_SYNC}},
+        {"as above, writes at the fast clock", {OP_DISABLE, OP_SYS_DIV, OP_SM_DIVS, OP_ENABLE_SYNC}, true},
+    };
+    // sys_clock.cpp's sequence
+    const strategy_t& firmware = strategies[4];
+
+    double sck_ns = 1e9 / ((double) FS * SCK_MULT);
+    double frame_ns = 1e9 / FS;
+    double bck_period_ns = 1e9 / ((double) FS * BIT_DEPTH * 2);
+    printf("%-46s %-6s %16s %16s %8s\n", "switch sequence", "", "max slip (SCK)", "max stretch", "locked");
+    bool ok = true;
+    for (const strategy_t& strategy : strategies) {
+        for (int up = 0; up < 2; up++) {
+            result_t result;
+            srand(1);
+            for (uint32_t i = 0; i < switches; i++) {
+                // anywhere in the first few frames
+                uint64_t lead = 1000 + rand() % (uint64_t) (4 * frame_ns / (1e9 / idle_hz));
+                if (up) run_switch(strategy, idle_hz, idle, full_hz, full, lead, &result);
+                else run_switch(strategy, full_hz, full, idle_hz, idle, lead, &result);
+            }
+            // BCK has to stay within one of its PIO ticks of where it was against SCK, and the
+            // clocks can't stall for more than a couple of BCK periods, so no sample loses a bit
+            uint32_t ratio = (idle.bck_d * 256 + idle.bck_f) / (idle.sck_d * 256 + idle.sck_f);
+            bool pass = result.max_slip < ratio && result.locked && result.max_stretch_ns < 2 * bck_period_ns;
+            if (&strategy == &firmware) ok = ok && pass;
+            printf("%-46s %-6s %10.1f (%2lld) %11.1f ns %8s%s\n", up ? "" : strategy.name, up ? "up" : "down",
+                   result.max_slip / (double) I2S_SCK_PIO_MULT, (long long) result.max_slip, result.max_stretch_ns,
+                   result.locked ? "yes" : "no", &strategy == &firmware ? "  <- firmware" : "");
+        }
+    }
+    printf("(slip: SCK cycles (PIO ticks) BCK moved against SCK; stretch: time the audio clock lost)\n");
+    printf("(SCK period %.1f ns, BCK period %.1f ns)\n", sck_ns, bck_period_ns);
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
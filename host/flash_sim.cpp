@@ -0,0 +1,217 @@
+/*
+ * Host simulation of saving a loop to flash (and loading it back) while the looper keeps playing.
+ *
+ * Runs the same flash_store_t bookkeeping the firmware uses against a simulated PSRAM and flash,
+ * with a timing model for the PSRAM bus, the PSRAM refills the audio needs every block, and the
+ * sector erase/program times on core1. Checks that no refill misses its deadline and that the
+ * loop survives the round trip. Then abandons a save half way, as the firmware does when the loop
+ * changes while it's being read, and checks that it leaves no loop behind and that the next save
+ * still works.
+ *
+ * usage: flash_sim [--seconds N] [--tracks N] [--psram-us-per-kb N] [--worst]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "flash_store.h"
+
+#define SAMPLE_RATE 48000
+#define BLOCK_SAMPLES 256 // BUFFER_SIZE in auto_looper.h
+#define REGION_SIZE (2 * 1024 * 1024)
+
+struct timing_t {
+    double psram_us_per_kb = 250;   // one 1KB PSRAM transfer
+    double erase_us = 45000;        // 4KB sector erase (typical for the W25Q series)
+    double page_us = 800;           // 256 byte page program
+};
+
+struct sim_t {
+    timing_t timing;
+    int tracks = 2;
+    double block_us = BLOCK_SAMPLES * 1e6 / SAMPLE_RATE;
+
+    std::vector<uint8_t> psram;
+    std::vector<uint8_t> flash = std::vector<uint8_t>(REGION_SIZE, 0xff);
+
+    flash_store_t store = flash_store_t(REGION_SIZE);
+
+    // core0
+    double now = 0;
+    double next_block = 0;
+    bool window = false;
+    // core1
+    flash_sector_t* worker_sector = nullptr;
+    double worker_done = 0;
+
+    // results
+    double min_slack = 1e9;
+    int missed = 0;
+    double psram_busy_us = 0;
+
+    // erase, then program: programming can only clear bits, like real NOR flash
+    void flash_write(flash_sector_t* sector) {
+        uint32_t offset = sector->index * FLASH_STORE_SECTOR_SIZE;
+        memset(&flash[offset], 0xff, FLASH_STORE_SECTOR_SIZE);
+        uint32_t size = (sector->fill + FLASH_STORE_PAGE_SIZE - 1) / FLASH_STORE_PAGE_SIZE * FLASH_STORE_PAGE_SIZE;
+        for (uint32_t i = 0; i < size; i++) flash[offset + i] &= sector->data[i];
+    }
+
+    double sector_us(flash_sector_t* sector) const {
+        uint32_t pages = (sector->fill + FLASH_STORE_PAGE_SIZE - 1) / FLASH_STORE_PAGE_SIZE;
+        return timing.erase_us + pages * timing.page_us;
+    }
+
+    // the refill burst for every track: write back one block and read the next, 1KB each way
+    void service_tracks() {
+        double request = next_block;
+        double duration = tracks * 2 * timing.psram_us_per_kb;
+        now = std::max(now, request) + duration;
+        psram_busy_us += duration;
+        double slack = request + block_us - now;
+        min_slack = std::min(min_slack, slack);
+        if (slack < 0) missed++;
+        next_block += block_us;
+        window = true;
+    }
+
+    // one pass of poll_flash_store in auto-looper.cpp
+    void poll_flash_store(bool streaming) {
+        if (worker_sector && worker_done <= now) {
+            if (store.sector_written(worker_sector)) printf("  save complete at %.2f s\n", now / 1e6);
+            worker_sector = nullptr;
+        }
+        flash_sector_t* ready = store.ready_sector();
+        if (ready && !worker_sector) {
+            store.sector_submitted(ready);
+            flash_write(ready);
+            worker_sector = ready;
+            worker_done = now + sector_us(ready);
+        }
+
+        if (streaming && !window) return;
+        window = false;
+
+        uint32_t start;
+        if (store.job == FLASH_JOB_SAVE) {
+            uint8_t* dest;
+            uint32_t count = store.next_save_chunk(&start, &dest);
+            if (count > 0) {
+                memcpy(dest, &psram[start * 4], count * 4);
+                double duration = count * 4 / 1024.0 * timing.psram_us_per_kb;
+                now += duration;
+                psram_busy_us += duration;
+                store.save_chunk_done(count);
+            }
+        } else if (store.job == FLASH_JOB_LOAD) {
+            uint32_t flash_offset;
+            uint32_t count = store.next_load_chunk(&start, &flash_offset);
+            memcpy(&psram[start * 4], &flash[flash_offset], count * 4);
+            double duration = count * 4 / 1024.0 * timing.psram_us_per_kb;
+            now += duration;
+            psram_busy_us += duration;
+            store.load_chunk_done(&flash[flash_offset], count);
+        }
+    }
+
+    // main loop: refills take priority, flash store work fits in around them. A save is abandoned
+    // once `abort_at` samples have been read, if that's nonzero
+    void run(bool streaming, uint32_t abort_at = 0) {
+        while (store.busy()) {
+            if (streaming && now >= next_block) {
+                service_tracks();
+            }
+            if (abort_at && store.progress >= abort_at) store.abort_save();
+            double before = now;
+            poll_flash_store(streaming);
+            if (now == before) {
+                // nothing to do until the next refill or until core1 finishes a sector
+                double next = worker_sector ? worker_done : 1e18;
+                if (streaming) next = std::min(next, next_block);
+                now = std::max(now, next);
+            }
+        }
+    }
+};
+
+int main(int argc, char** argv) {
+    double seconds = 5;
+    sim_t sim;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--seconds") && i + 1 < argc) seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--tracks") && i + 1 < argc) sim.tracks = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--psram-us-per-kb") && i + 1 < argc) sim.timing.psram_us_per_kb = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--worst")) {
+            // datasheet maximums
+            sim.timing.erase_us = 400000;
+            sim.timing.page_us = 3000;
+        } else {
+            printf("usage: %s [--seconds N] [--tracks N] [--psram-us-per-kb N] [--worst]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    uint32_t loop_length = (uint32_t)(seconds * SAMPLE_RATE) / BLOCK_SAMPLES * BLOCK_SAMPLES;
+    sim.psram.resize(loop_length * 4);
+    srand(1);
+    for (uint8_t& byte : sim.psram) byte = rand();
+    std::vector<uint8_t> original = sim.psram;
+
+    printf("loop: %u samples (%.1f s), %d tracks streaming, block period %.0f us\n",
+           loop_length, loop_length / (double) SAMPLE_RATE, sim.tracks, sim.block_us);
+    printf("timing: PSRAM %.0f us/KB, erase %.0f us, page program %.0f us\n",
+           sim.timing.psram_us_per_kb, sim.timing.erase_us, sim.timing.page_us);
+
+    flash_store_header_t header = {};
+    header.loop_length = loop_length;
+    if (!sim.store.begin_save(0, header)) {
+        printf("loop doesn't fit in the flash store (max %u samples)\n", sim.store.max_samples());
+        return 1;
+    }
+    double start = sim.now;
+    sim.run(true);
+    double save_time = sim.now - start;
+
+    flash_store_header_t saved;
+    memcpy(&saved, &sim.flash[0], sizeof(saved));
+    bool data_ok = memcmp(&sim.flash[FLASH_STORE_SECTOR_SIZE], original.data(), original.size()) == 0;
+
+    // load it back into an empty PSRAM, still streaming the other tracks
+    std::fill(sim.psram.begin(), sim.psram.end(), 0);
+    start = sim.now;
+    bool load_started = sim.store.begin_load(0, saved);
+    if (load_started) sim.run(true);
+    double load_time = sim.now - start;
+    bool load_ok = load_started && sim.store.load_ok() && sim.psram == original;
+
+    // abandon a save half way, then save again
+    bool aborted_ok = sim.store.begin_save(0, header);
+    sim.run(true, loop_length / 2);
+    flash_store_header_t after_abort;
+    memcpy(&after_abort, &sim.flash[0], sizeof(after_abort));
+    aborted_ok = aborted_ok && !sim.store.header_valid(after_abort);
+    bool resaved = sim.store.begin_save(0, header);
+    if (resaved) sim.run(true);
+    flash_store_header_t resaved_header;
+    memcpy(&resaved_header, &sim.flash[0], sizeof(resaved_header));
+    resaved = resaved && sim.store.header_valid(resaved_header) && memcmp(&sim.flash[FLASH_STORE_SECTOR_SIZE], original.data(), original.size()) == 0;
+
+    printf("save: %.2f s, load: %.2f s\n", save_time / 1e6, load_time / 1e6);
+    printf("refills: min slack %.0f us, %d missed deadlines\n", sim.min_slack, sim.missed);
+    printf("PSRAM bus busy %.1f%% of the time\n", 100 * sim.psram_busy_us / sim.now);
+    printf("audio ISR time spent waiting on flash: 0 us (copy_to_ram, flash ops run on core1)\n");
+    printf("header %s, flash data %s, reload %s\n",
+           sim.store.header_valid(saved) ? "valid" : "INVALID", data_ok ? "matches" : "DIFFERS",
+           load_ok ? "matches" : "DIFFERS");
+
+    printf("abandoned save %s, the save after it %s\n", aborted_ok ? "left no loop" : "LEFT A LOOP",
+           resaved ? "matches" : "DIFFERS");
+
+    bool ok = sim.missed == 0 && data_ok && load_ok && sim.store.header_valid(saved) && aborted_ok && resaved;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
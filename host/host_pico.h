@@ -0,0 +1,18 @@
+#ifndef HOST_PICO_H
+#define HOST_PICO_H
+
+#include <stdint.h>
+
+/*
+ * What the host build of the looper engine (src/looper.cpp) runs on instead of the Pico SDK
+ * and the PSRAM chip. Like `looper_ctx`, the clock and the PSRAM are per thread, so each thread
+ * can run a looper of its own.
+ */
+
+extern thread_local uint64_t host_time_us; // what time_us_64() returns. The caller advances it, one sample at a time
+uint8_t* host_psram();                     // the PSRAM stand-in, PSRAM_SIZE_BYTES long
+
+// psram_ram.cpp only: give this thread its own PSRAM_SIZE_BYTES of PSRAM (nullptr goes back to the shared one)
+void host_psram_use(uint8_t* psram);
+
+#endif
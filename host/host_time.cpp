@@ -0,0 +1,11 @@
+#include "pico/stdlib.h"
+
+#include "host_pico.h"
+
+// the clock the looper engine sees: whatever the caller has advanced it to. Each thread has its own
+
+thread_local uint64_t host_time_us = 0;
+
+uint64_t time_us_64() {
+    return host_time_us;
+}
@@ -0,0 +1,295 @@
+/*
+ * Host benchmark of the looper engine (src/looper.cpp, built unchanged against a PSRAM stand-in).
+ *
+ * Plays a scripted session on the master track: record a loop, play it back, play it backwards all
+ * the way round, overdub a layer over half of it (or as much as the scratch buffer needs), then play
+ * back again. For each phase it
+ * reports the per-sample cost of the audio path, the cost of a refill burst, the PSRAM traffic and
+ * how many block write-backs were skipped because the block was only played back or is silent.
+ * The loop starts with a second of silence, like a count-in. Playback is checked against what was
+ * recorded, from the second time round, fades included: the track has to fade out and back in
+ * right where its loop wraps, and nowhere else.
+ *
+ * Reverse reads are also checked on their own, for loop lengths that aren't whole blocks (the
+ * master's always is), so the reads that wrap around the loop start are split.
+ *
+ * It also reads the level meters the way the firmware streams them, checks the input and output
+ * meters against the same levels worked out directly, and prints the levels of each phase.
+ *
+ * --stall-every N holds up every Nth refill for one and a half block periods, like a main loop
+ * that is stuck on the PSRAM bus. The overrun handling has to bring the loop back in step. Below 3
+ * the bus can't keep up at all, and the overdub can't finish in time for the scripted tap.
+ *
+ * usage: looper_bench [--loop-seconds N] [--play-seconds N] [--stall-every N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include "pico/stdlib.h"
+
+#include "auto_looper.h"
+#include "host_pico.h"
+
+#define SAMPLE_RATE 48000
+#define TAP_US 50000 // how long the footswitch is held down for a tap
+#define STALL_SAMPLES (BUFFER_SIZE * 3 / 2)
+
+using bench_clock = std::chrono::steady_clock;
+
+struct phase_t {
+    const char* name;
+    uint64_t samples = 0;
+    double audio_ns = 0;   // time in get_next_sample
+    double service_ns = 0; // time in service_tracks
+    uint32_t bursts = 0;
+    uint32_t mismatches = 0; // samples that didn't play back what was recorded
+    psram_stats_t stats = {};
+    meter_t levels[NUM_METERS] = {}; // every window that ended in the phase, added up
+    uint32_t level_samples = 0;
+};
+
+static uint64_t sample_count = 0;
+static uint64_t release_at = 0; // sample at which the footswitch goes back up, or 0
+static uint64_t silent_until = 0; // the input is silent up to this sample
+static uint stall_every = 0;
+static uint refills = 0;
+static uint64_t service_at = 0; // sample at which the pending refill gets serviced, or 0
+static std::vector<int16_t> recorded(PSRAM_TRACK_SAMPLES + BUFFER_SIZE); // the first recording, by position
+
+static uint played_count = 0;
+
+// the input and output levels worked out directly, for the window the meters are adding up
+static meter_t direct_in = {}, direct_out = {};
+static uint32_t last_window = 0;
+static uint32_t windows_checked = 0;
+static uint32_t meter_mismatches = 0;
+
+static bool same_levels(const meter_t& a, const meter_t& b) {
+    return a.peak == b.peak && a.clips == b.clips && a.sum_squares == b.sum_squares;
+}
+
+// pick up a newly published window like poll_meters() does, and check it
+static void read_meters(phase_t& phase) {
+    meter_window_t window;
+    if (!looper_ctx->level_meters.read(&window, last_window)) return;
+    if (window.window != last_window + 1) meter_mismatches++; // the bench reads after every sample, so none may be missed
+    last_window = window.window;
+
+    windows_checked++;
+    if (!same_levels(window.meters[METER_INPUT], direct_in) || !same_levels(window.meters[METER_OUTPUT], direct_out)) {
+        meter_mismatches++;
+    }
+    direct_in = {};
+    direct_out = {};
+
+    for (uint m = 0; m < NUM_METERS; m++) {
+        meter_t& level = phase.levels[m];
+        if (window.meters[m].peak > level.peak) level.peak = window.meters[m].peak;
+        level.clips += window.meters[m].clips;
+        level.sum_squares += window.meters[m].sum_squares;
+    }
+    phase.level_samples += window.samples;
+}
+
+// what playback should play at `position`: the loop is the first `loop_length` samples recorded
+static int16_t expected(uint position, uint loop_length) {
+    return recorded[position % loop_length];
+}
+
+// the whole track's fade at the loop boundary, at staging position `position`
+static int32_t loop_fade(uint position, uint loop_length) {
+    fade_edge_t edges[2] = {{0, true}, {loop_length, false}};
+    return edge_factor(edges, 2, position % loop_length, loop_length);
+}
+
+static int16_t input_sample() {
+    if (sample_count < silent_until) return 0;
+    // not silence, so a skipped write-back that shouldn't have been would show up
+    return (int16_t) (8000 * sin(2 * M_PI * 220 * sample_count / SAMPLE_RATE));
+}
+
+static void tap(track_t& t) {
+    footswitch_changed(t, false);
+    release_at = sample_count + (uint64_t) TAP_US * SAMPLE_RATE / 1000000;
+}
+
+static void run(phase_t& phase, track_t& t, double seconds) {
+    looper_ctx->psram_stats = {};
+    uint64_t end = sample_count + (uint64_t) (seconds * SAMPLE_RATE);
+    while (sample_count < end) {
+        host_time_us = sample_count * 1000000 / SAMPLE_RATE;
+        if (release_at && sample_count >= release_at) {
+            footswitch_changed(t, true);
+            release_at = 0;
+        }
+
+        int16_t input = input_sample();
+        bool repeating = t.looper.fallback; // a block is being repeated after an overrun, nothing is recorded
+        bool fading = repeating || t.looper.fade_left > 0;
+        bool varispeed = t.looper.prefetch.block_rate != PLAYBACK_RATE_UNITY;
+        uint index = varispeed ? t.looper.prefetch.index() : t.looper.buffer_offset[t.looper.which];
+        uint position = t.looper.buffer_start[t.looper.which] + index;
+
+        auto start = bench_clock::now();
+        int16_t output = get_next_sample(input);
+        auto mid = bench_clock::now();
+        direct_in.add(input);
+        direct_out.add(output);
+
+        // the state the sample was handled in: a tap takes effect in the same call
+        state_t state = t.state;
+        if (state == FIRST_RECORD && !repeating) {
+            recorded[position] = input;
+        } else if (state == FIRST_PLAYBACK && ++played_count > t.looper.loop_length + BUFFER_SIZE && !fading) {
+            // the envelope interpolates the fade, which can be a step off
+            int32_t factor = varispeed ? GAIN_UNITY : loop_fade(position, t.looper.loop_length); // no edge fades off 1x
+            int16_t want = mix_layers(expected(position, t.looper.loop_length), 0, factor, 0);
+            if (abs(output - input - want) > (factor < GAIN_UNITY ? 1 : 0)) phase.mismatches++;
+        }
+        if (looper_ctx->signal_write && service_at == 0) {
+            refills++;
+            service_at = stall_every && refills % stall_every == 0 ? sample_count + STALL_SAMPLES : sample_count;
+        }
+        if (looper_ctx->signal_write && sample_count >= service_at) {
+            service_at = 0;
+            service_tracks();
+            phase.bursts++;
+            phase.service_ns += std::chrono::duration<double, std::nano>(bench_clock::now() - mid).count();
+        }
+        phase.audio_ns += std::chrono::duration<double, std::nano>(mid - start).count();
+        read_meters(phase);
+        sample_count++;
+        phase.samples++;
+    }
+    phase.stats = looper_ctx->psram_stats;
+}
+
+/**
+ * Read a loop backwards the way reverse playback does: each block is the one before the last
+ * (prefetch_t::next_block), fetched through psram_transfer and played from its end. The loop
+ * lengths aren't whole blocks, so the blocks that cross the loop start are split reads, and the
+ * head is read from SRAM. Every sample has to be the one just before the last, all the way round
+ * twice. Uses the last track, after the session is over. Returns how many samples were wrong.
+*/
+static uint32_t check_reverse_reads() {
+    track_t& t = looper_ctx->tracks[NUM_TRACKS - 1];
+    const uint lengths[] = {300, 1000, 1061, 3 * BUFFER_SIZE + LOOP_HEAD_SIZE + 77};
+    static int16_t loop[3 * BUFFER_SIZE + LOOP_HEAD_SIZE + 77][2];
+    int16_t block[BUFFER_SIZE][2];
+    uint32_t wrong = 0;
+
+    for (uint loop_length : lengths) {
+        t.looper.loop_length = loop_length;
+        for (uint i = 0; i < loop_length; i++) {
+            loop[i][MAIN_SAMPLE] = (int16_t) (i + 1); // never silent, so every block goes out
+            loop[i][ACTIVE_SAMPLE] = (int16_t) -(i + 1);
+        }
+        psram_transfer(t, 0, loop, loop_length, true);
+
+        uint block_start = 0, expected = loop_length - 1, played = 0;
+        while (played < 2 * loop_length) {
+            block_start = prefetch_t::next_block(block_start, loop_length, -PLAYBACK_RATE_UNITY);
+            psram_transfer(t, block_start, block, BUFFER_SIZE, false);
+            for (uint i = BUFFER_SIZE; i-- > 0; played++) {
+                if (block[i][MAIN_SAMPLE] != loop[expected][MAIN_SAMPLE] ||
+                    block[i][ACTIVE_SAMPLE] != loop[expected][ACTIVE_SAMPLE]) wrong++;
+                expected = (expected + loop_length - 1) % loop_length;
+            }
+        }
+    }
+    t.looper.loop_length = 0;
+    return wrong;
+}
+
+int main(int argc, char** argv) {
+    double loop_seconds = 4;
+    double play_seconds = 8;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--loop-seconds") && i + 1 < argc) loop_seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--play-seconds") && i + 1 < argc) play_seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--stall-every") && i + 1 < argc) stall_every = atoi(argv[++i]);
+        else {
+            printf("usage: %s [--loop-seconds N] [--play-seconds N] [--stall-every N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (uint i = 0; i < NUM_TRACKS; i++) {
+        looper_ctx->tracks[i].id = i;
+        looper_ctx->tracks[i].psram_base = psram_partition(i);
+    }
+    track_t& t = MASTER_TRACK;
+
+    // the overdub has to outlast the scratch buffer and then its merge (one block per refill, or
+    // every other refill while blocks are being missed), or the tap that ends it comes too early
+    // and is lost. It also has to be shorter than the loop: a full-length layer keeps overdubbing forever
+    double scratch_seconds = (double) SCRATCH_BUFFER_SIZE / SAMPLE_RATE;
+    double overdub_seconds = std::max(loop_seconds / 2, (stall_every ? 3 : 2) * scratch_seconds + 0.1);
+    if (overdub_seconds >= loop_seconds) {
+        printf("the loop has to be longer than %.2f s to overdub over part of it\n", overdub_seconds);
+        return 1;
+    }
+
+    phase_t phases[] = {{"record"}, {"playback"}, {"reverse playback"}, {"back to 1x"}, {"overdub"}, {"playback after overdub"}};
+    phase_t idle = {"idle"};
+
+    run(idle, t, 0.1);
+    silent_until = sample_count + SAMPLE_RATE;
+    tap(t); // start the first recording
+    run(phases[0], t, loop_seconds);
+    tap(t); // close the loop
+    run(phases[1], t, play_seconds);
+    set_playback_rate(-PLAYBACK_RATE_UNITY);
+    run(phases[2], t, loop_seconds + 1); // all the way round backwards, past the loop start
+    set_playback_rate(PLAYBACK_RATE_UNITY);
+    run(phases[3], t, 0.1);              // back to 1x forward at the next block boundary
+    tap(t); // long enough after the last press to start an overdub
+    run(phases[4], t, overdub_seconds);
+    tap(t); // back to playback, the new layer gets committed on the next pass
+    run(phases[5], t, play_seconds);
+
+    printf("\n%-24s %10s %12s %10s %12s %12s %18s %14s %11s %9s\n", "phase", "ns/sample", "us/refill", "refills",
+           "KB read/s", "KB written/s", "write-backs", "silent blocks", "head reads", "overruns");
+    uint32_t mismatches = 0;
+    for (phase_t& phase : phases) {
+        double seconds = phase.samples / (double) SAMPLE_RATE;
+        uint32_t swaps = phase.stats.writebacks + phase.stats.writebacks_skipped;
+        printf("%-24s %10.1f %12.2f %10u %12.1f %12.1f %6u/%-4u (%3.0f%%) %14u %11u %9u\n", phase.name,
+               phase.audio_ns / phase.samples, phase.bursts ? phase.service_ns / phase.bursts / 1000 : 0,
+               phase.bursts, phase.stats.bytes_read / 1024.0 / seconds, phase.stats.bytes_written / 1024.0 / seconds,
+               phase.stats.writebacks, swaps, swaps ? 100.0 * phase.stats.writebacks_skipped / swaps : 0,
+               phase.stats.silent_skipped, phase.stats.head_hits, phase.stats.overruns);
+        mismatches += phase.mismatches;
+    }
+    printf("(write-backs: done/block swaps, percentage skipped because the block was clean)\n");
+
+    const uint meters[] = {METER_INPUT, METER_TRACK(0, MAIN_SAMPLE), METER_TRACK(0, ACTIVE_SAMPLE), METER_TRACK(0, METER_MIX), METER_OUTPUT};
+    printf("\n%-24s %14s %14s %14s %14s %14s %7s\n", "levels (peak/RMS dBFS)", "input", "track 0 main", "track 0 active",
+           "track 0 mix", "output", "clips");
+    for (phase_t& phase : phases) {
+        printf("%-24s", phase.name);
+        uint32_t clips = 0;
+        for (uint m : meters) {
+            printf(" %6.1f/%-7.1f", meter_peak_db(phase.levels[m]), meter_rms_db(phase.levels[m], phase.level_samples));
+            clips += phase.levels[m].clips;
+        }
+        printf(" %7u\n", clips);
+    }
+    printf("level meters: %u windows, %u didn't match the levels worked out directly\n", windows_checked, meter_mismatches);
+
+    uint32_t reverse_wrong = check_reverse_reads();
+    printf("reverse reads of loops that aren't whole blocks: %u samples out of place\n", reverse_wrong);
+
+    bool ok = t.state == PLAY && mismatches == 0 && meter_mismatches == 0 && windows_checked > 0 && reverse_wrong == 0;
+    if (t.state != PLAY) printf("the session ended in %s instead of PLAY\n", state_names[t.state]);
+    if (mismatches) printf("%u samples didn't play back what was recorded\n", mismatches);
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,244 @@
+/*
+ * Host benchmark and check of the per-layer gain mix (src/layer_gain.h).
+ *
+ * Times three ways of mixing a block of main and active samples: the old unity mix with two
+ * saturating adds, the Q15 envelope mix the looper uses now, and per-sample float gains for
+ * comparison. The host has an FPU and the M0+ doesn't, so on the device the float version is far
+ * further behind than it looks here.
+ *
+ * Then it checks the envelopes: that the piecewise-linear plan stays close to the exact gain, that
+ * a gain change ramps instead of stepping, that the fades take the click out of a jump at the loop
+ * boundary and at active region edges, and that committing an active region at a reduced gain
+ * doesn't change what is heard.
+ *
+ * usage: mix_bench [--blocks N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+
+#include "layer_gain.h"
+
+#define BLOCK_SAMPLES 256 // BUFFER_SIZE in auto_looper.h
+
+using bench_clock = std::chrono::steady_clock;
+
+// the mix before per-layer gains (add() in auto_looper.h)
+static inline int16_t add(int16_t a, int16_t b) {
+    int16_t result = a + b;
+    if ((a > 0 && b > 0 && result < 0) || (a < 0 && b < 0 && result > 0)) {
+        return a > 0 ? INT16_MAX : INT16_MIN;
+    }
+    return result;
+}
+
+struct block_t {
+    int16_t main[BLOCK_SAMPLES];
+    int16_t active[BLOCK_SAMPLES];
+    bool play_active[BLOCK_SAMPLES];
+};
+
+static double time_kernel(const char* name, std::vector<block_t>& blocks, int16_t (*kernel)(const block_t&, uint32_t)) {
+    int64_t checksum = 0;
+    auto start = bench_clock::now();
+    for (const block_t& block : blocks) checksum += kernel(block, &block - &blocks[0]);
+    double ns = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+    double per_sample = ns / (blocks.size() * BLOCK_SAMPLES);
+    printf("%-36s %8.2f ns/sample   (checksum %lld)\n", name, per_sample, (long long) checksum);
+    return per_sample;
+}
+
+static int16_t mix_unity(const block_t& block, uint32_t) {
+    int16_t last = 0;
+    int16_t out[BLOCK_SAMPLES];
+    for (uint32_t i = 0; i < BLOCK_SAMPLES; i++) {
+        int16_t mixed = 0;
+        if (block.play_active[i]) mixed = add(mixed, block.active[i]);
+        out[i] = add(mixed, block.main[i]);
+    }
+    for (int16_t o : out) last ^= o;
+    return last;
+}
+
+static layer_gain_t gains[2];
+static const fade_edge_t loop_edges[2] = {{0, true}, {BLOCK_SAMPLES * 40, false}};
+static const fade_edge_t region_edges[2] = {{BLOCK_SAMPLES * 3 + 17, true}, {BLOCK_SAMPLES * 9 + 100, false}};
+
+static int16_t mix_q15(const block_t& block, uint32_t n) {
+    // plan the block like plan_gains() in looper.cpp, then mix
+    uint32_t loop_length = BLOCK_SAMPLES * 40;
+    uint32_t start = n * BLOCK_SAMPLES % loop_length;
+    int32_t from = gains[0].ramp();
+    gains[0].envelope.plan(start, BLOCK_SAMPLES, loop_length, from, gains[0].gain, loop_edges, 2);
+    from = gains[1].ramp();
+    gains[1].envelope.plan(start, BLOCK_SAMPLES, loop_length, from, gains[1].gain, region_edges, 2);
+
+    int16_t last = 0;
+    int16_t out[BLOCK_SAMPLES];
+    for (uint32_t i = 0; i < BLOCK_SAMPLES; i++) {
+        int32_t main_gain = gains[0].envelope.tick();
+        int32_t active_gain = gains[1].envelope.tick();
+        out[i] = mix_layers(block.main[i], block.active[i], main_gain, block.play_active[i] ? active_gain : 0);
+    }
+    for (int16_t o : out) last ^= o;
+    return last;
+}
+
+static int16_t mix_float(const block_t& block, uint32_t n) {
+    static float main_gain = 1, active_gain = 1;
+    float main_step = (n % 16 < 8 ? -0.5f : 0.5f) / (8 * BLOCK_SAMPLES);
+    int16_t last = 0;
+    int16_t out[BLOCK_SAMPLES];
+    for (uint32_t i = 0; i < BLOCK_SAMPLES; i++) {
+        main_gain += main_step;
+        active_gain -= main_step;
+        float sum = block.main[i] + (block.play_active[i] ? block.active[i] * active_gain : 0);
+        float o = sum * main_gain;
+        out[i] = o > INT16_MAX ? INT16_MAX : o < INT16_MIN ? INT16_MIN : (int16_t) o;
+    }
+    for (int16_t o : out) last ^= o;
+    return last;
+}
+
+// the gains a block plan is interpolating, worked out exactly for one sample
+static int32_t exact_gain(uint32_t start, uint32_t i, uint32_t loop_length, int32_t from, int32_t to,
+                          const fade_edge_t* edges, uint32_t count) {
+    double user = from + (to - from) * (double) i / BLOCK_SAMPLES;
+    return (int32_t) (user * edge_factor(edges, count, (start + i) % loop_length, loop_length) / GAIN_UNITY);
+}
+
+/**
+ * The largest jump between neighbouring output samples, going round the loop twice. With
+ * `region` it's the active layer at a constant level, playing between the two edges; otherwise
+ * it's the main layer playing a sawtooth that jumps at the loop boundary.
+*/
+static int32_t largest_step(const fade_edge_t* edges, uint32_t loop_length, bool fade, bool region) {
+    int32_t largest = 0;
+    int32_t previous = 0;
+    for (uint32_t start = 0; start < 2 * loop_length; start += BLOCK_SAMPLES) {
+        envelope_t envelope;
+        envelope.plan(start % loop_length, BLOCK_SAMPLES, loop_length, GAIN_UNITY, GAIN_UNITY, edges, fade ? 2 : 0);
+        for (uint32_t i = 0; i < BLOCK_SAMPLES; i++) {
+            uint32_t p = (start + i) % loop_length;
+            int32_t gain = envelope.tick();
+            int16_t out;
+            if (region) {
+                bool playing = p >= edges[0].position && p < edges[1].position;
+                out = mix_layers(0, 20000, GAIN_UNITY, playing ? gain : 0);
+            } else {
+                out = mix_layers(p * 40000 / loop_length - 20000, 0, gain, 0);
+            }
+            if (start + i > 0 && abs(out - previous) > largest) largest = abs(out - previous);
+            previous = out;
+        }
+    }
+    return largest;
+}
+
+int main(int argc, char** argv) {
+    uint32_t block_count = 20000;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--blocks") && i + 1 < argc) block_count = atoi(argv[++i]);
+        else {
+            printf("usage: %s [--blocks N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<block_t> blocks(block_count);
+    srand(1);
+    for (block_t& block : blocks) {
+        for (uint32_t i = 0; i < BLOCK_SAMPLES; i++) {
+            block.main[i] = rand() % 40000 - 20000;
+            block.active[i] = rand() % 40000 - 20000;
+            block.play_active[i] = (i / 64) % 2;
+        }
+    }
+
+    printf("%u blocks of %d samples\n", block_count, BLOCK_SAMPLES);
+    double unity_ns = time_kernel("unity mix (two saturating adds)", blocks, mix_unity);
+    // keep the gains moving so the envelopes aren't flat
+    gains[0].target = GAIN_UNITY / 2;
+    gains[1].target = GAIN_UNITY / 4;
+    double q15_ns = time_kernel("Q15 envelopes with fades", blocks, mix_q15);
+    time_kernel("float gains (host FPU)", blocks, mix_float);
+    printf("Q15 envelopes against the unity mix: %+.2f ns/sample on this machine\n\n", q15_ns - unity_ns);
+
+    bool ok = true;
+
+    // 1. the plan against the exact gain, for ramps crossing fades
+    int32_t worst = 0;
+    uint32_t loop_length = BLOCK_SAMPLES * 7 + 40;
+    fade_edge_t edges[4] = {{0, true}, {loop_length, false}, {300, true}, {1000, false}};
+    for (uint32_t start = 0; start < loop_length; start += 37) {
+        int32_t from = rand() % GAIN_UNITY, to = rand() % GAIN_UNITY;
+        envelope_t envelope;
+        envelope.plan(start, BLOCK_SAMPLES, loop_length, from, to, edges, 4);
+        for (uint32_t i = 0; i < BLOCK_SAMPLES; i++) {
+            int32_t error = abs(envelope.tick() - exact_gain(start, i, loop_length, from, to, edges, 4));
+            if (error > worst) worst = error;
+        }
+    }
+    // the fades are 32 samples, so a product of two ramps bends at most a few percent off a straight line
+    bool plan_ok = worst < GAIN_UNITY / 32;
+    ok = ok && plan_ok;
+    printf("envelope plan vs exact gain: worst %d/%d (%.2f%%) %s\n", worst, GAIN_UNITY, 100.0 * worst / GAIN_UNITY,
+           plan_ok ? "ok" : "TOO FAR OFF");
+
+    // 2. a gain change ramps, and gets there
+    layer_gain_t layer;
+    layer.target = 0;
+    int32_t previous = GAIN_UNITY;
+    int32_t largest = 0;
+    uint32_t blocks_taken = 0;
+    for (; blocks_taken < 100 && (layer.gain != 0 || blocks_taken == 0); blocks_taken++) {
+        int32_t from = layer.ramp();
+        layer.envelope.plan(0, BLOCK_SAMPLES, 0, from, layer.gain, nullptr, 0);
+        for (uint32_t i = 0; i < BLOCK_SAMPLES; i++) {
+            int32_t gain = layer.envelope.tick();
+            if (abs(gain - previous) > largest) largest = abs(gain - previous);
+            previous = gain;
+        }
+    }
+    layer.envelope.plan(0, BLOCK_SAMPLES, 0, layer.ramp(), layer.gain, nullptr, 0);
+    previous = layer.envelope.tick(); // where the last block ended up
+    bool ramp_ok = largest <= GAIN_RAMP_PER_BLOCK / BLOCK_SAMPLES + 1 && previous == 0;
+    ok = ok && ramp_ok;
+    printf("unity to 0: %u blocks, largest step %d per sample, ends at %d %s\n", blocks_taken, largest, previous,
+           ramp_ok ? "ok" : "STEPS");
+
+    // 3. clicks at the loop boundary and at region edges
+    uint32_t fade_loop = BLOCK_SAMPLES * 10;
+    fade_edge_t loop[2] = {{0, true}, {fade_loop, false}};
+    fade_edge_t region[2] = {{700, true}, {1900, false}};
+    int32_t loop_hard = largest_step(loop, fade_loop, false, false), loop_soft = largest_step(loop, fade_loop, true, false);
+    int32_t region_hard = largest_step(region, fade_loop, false, true), region_soft = largest_step(region, fade_loop, true, true);
+    // a fade over EDGE_FADE samples steps by about level/EDGE_FADE, plus a little for the interpolation
+    int32_t limit = 20000 / EDGE_FADE * 5 / 4;
+    bool clicks_ok = loop_soft <= limit && region_soft <= limit;
+    ok = ok && clicks_ok;
+    printf("largest sample step at the loop boundary: %d without fades, %d with %s\n", loop_hard, loop_soft,
+           loop_soft <= limit ? "ok" : "CLICKS");
+    printf("largest sample step at region edges: %d without fades, %d with %s\n", region_hard, region_soft,
+           clicks_ok ? "ok" : "CLICKS");
+
+    // 4. committing at a reduced active gain sounds the same
+    int32_t commit_error = 0;
+    for (int i = 0; i < 100000; i++) {
+        int16_t main = rand() % 30000 - 15000, active = rand() % 30000 - 15000;
+        int32_t main_gain = rand() % (GAIN_UNITY + 1), active_gain = rand() % (GAIN_UNITY + 1);
+        int16_t before = mix_layers(main, active, main_gain, active_gain);
+        int16_t after = mix_layers(commit_layers(main, active, active_gain), 0, main_gain, 0);
+        if (abs(before - after) > commit_error) commit_error = abs(before - after);
+    }
+    bool commit_ok = commit_error <= 1;
+    ok = ok && commit_ok;
+    printf("commit changes the output by at most %d LSB %s\n", commit_error, commit_ok ? "ok" : "AUDIBLY");
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
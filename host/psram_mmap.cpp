@@ -0,0 +1,155 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "pico/stdlib.h"
+#include "ice_sram.h"
+
+#include "auto_looper.h"
+#include "host_pico.h"
+#include "session_file.h"
+
+// PSRAM stand-in in a memory-mapped session file (see session_file.h). psram_ram.cpp keeps it in host memory instead
+
+static int session_fd = -1;
+static uint8_t* session_map = nullptr;
+
+bool session_open(const char* path, bool create) {
+    session_close();
+    int fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+    // a new session is one big hole: only the blocks the engine writes take up disk space
+    if (create && ftruncate(fd, SESSION_FILE_BYTES) != 0) {
+        perror(path);
+        close(fd);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t) st.st_size != SESSION_FILE_BYTES) {
+        printf("%s is not a session for this build (%lld bytes, expected %lld)\n", path, (long long) st.st_size,
+               (long long) SESSION_FILE_BYTES);
+        close(fd);
+        return false;
+    }
+
+    void* map = mmap(nullptr, SESSION_FILE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror(path);
+        close(fd);
+        return false;
+    }
+    session_fd = fd;
+    session_map = (uint8_t*) map;
+
+    session_info_t* info = session_info();
+    if (create) {
+        info->magic = SESSION_MAGIC;
+        info->version = SESSION_VERSION;
+        info->psram_size_bytes = PSRAM_SIZE_BYTES;
+        info->num_tracks = NUM_TRACKS;
+        info->buffer_size = BUFFER_SIZE;
+    } else if (info->magic != SESSION_MAGIC || info->version != SESSION_VERSION || info->psram_size_bytes != PSRAM_SIZE_BYTES ||
+               info->num_tracks != NUM_TRACKS || info->buffer_size != BUFFER_SIZE) {
+        printf("%s is not a session for this build\n", path);
+        session_close();
+        return false;
+    }
+    return true;
+}
+
+void session_close() {
+    if (!session_map) return;
+    msync(session_map, SESSION_FILE_BYTES, MS_SYNC);
+    munmap(session_map, SESSION_FILE_BYTES);
+    close(session_fd);
+    session_map = nullptr;
+    session_fd = -1;
+}
+
+session_info_t* session_info() {
+    return (session_info_t*) (host_psram() + PSRAM_SIZE_BYTES);
+}
+
+uint8_t* host_psram() {
+    if (!session_map) {
+        fprintf(stderr, "PSRAM used with no session file open\n");
+        abort();
+    }
+    return session_map;
+}
+
+void ice_sram_read_blocking(uint32_t addr, uint8_t *data, size_t data_size) {
+    memcpy(data, host_psram() + addr, data_size);
+}
+
+void ice_sram_write_blocking(uint32_t addr, const uint8_t *data, size_t data_size) {
+    memcpy(host_psram() + addr, data, data_size);
+}
+
+bool session_save(track_t& t) {
+    looper_t& looper = t.looper;
+    if (t.state == IDLE || t.state == FIRST_RECORD || looper.scratch_buffer_size != 0 || !looper.old_active_start.empty()) {
+        return false;
+    }
+
+    session_track_t& saved = session_info()->tracks[t.id];
+    saved.loop_length = looper.loop_length;
+    saved.active_start = looper.active_start;
+    saved.active_size = looper.active_size;
+    saved.undo_mode = looper.undo_mode;
+    memcpy(saved.silent, looper.silence.silent, sizeof(saved.silent));
+
+    // silent blocks are never written, so an earlier loop may have left something there
+    uint blocks = (looper.loop_length + BUFFER_SIZE - 1) / BUFFER_SIZE;
+    for (uint block = 0; block < blocks; block++) {
+        if (!looper.silence.is_silent(block)) continue;
+        uint8_t* data = host_psram() + t.psram_base + block * BUFFER_SIZE * 4;
+        for (uint i = 0; i < BUFFER_SIZE * 4; i++) {
+            if (data[i]) {
+                memset(data, 0, BUFFER_SIZE * 4);
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+bool session_restore(track_t& t) {
+    looper_t& looper = t.looper;
+    const session_track_t& saved = session_info()->tracks[t.id];
+    if (t.state != IDLE || t.loading || saved.loop_length == 0) return false;
+
+    looper.loop_length = saved.loop_length;
+    looper.active_start = saved.active_start;
+    looper.active_size = saved.active_size;
+    looper.undo_mode = saved.undo_mode;
+    memcpy(looper.silence.silent, saved.silent, sizeof(saved.silent));
+    // the loop head is the only part that has to be in memory before playing. The rest is paged in
+    // as the refills reach it
+    memcpy(looper.head, host_psram() + t.psram_base, sizeof(looper.head));
+    start_stopped(t);
+    return true;
+}
+
+size_t session_resident_bytes() {
+    size_t page = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> resident((PSRAM_SIZE_BYTES + page - 1) / page);
+    if (mincore(host_psram(), PSRAM_SIZE_BYTES, resident.data()) != 0) return 0;
+    size_t pages = 0;
+    for (unsigned char r : resident) pages += r & 1;
+    return pages * page;
+}
+
+void session_drop_cache() {
+    msync(host_psram(), PSRAM_SIZE_BYTES, MS_SYNC);
+    madvise(host_psram(), PSRAM_SIZE_BYTES, MADV_DONTNEED); // unmap the pages here, so they can be evicted
+    posix_fadvise(session_fd, 0, PSRAM_SIZE_BYTES, POSIX_FADV_DONTNEED);
+}
@@ -0,0 +1,31 @@
+#include <string.h>
+
+#include <vector>
+
+#include "pico/stdlib.h"
+#include "ice_sram.h"
+
+#include "auto_looper.h"
+#include "host_pico.h"
+
+// PSRAM stand-in kept in host memory. psram_mmap.cpp keeps it in a session file instead
+
+static thread_local uint8_t* thread_psram = nullptr;
+
+void host_psram_use(uint8_t* psram) {
+    thread_psram = psram;
+}
+
+uint8_t* host_psram() {
+    if (thread_psram) return thread_psram;
+    static std::vector<uint8_t> psram(PSRAM_SIZE_BYTES);
+    return psram.data();
+}
+
+void ice_sram_read_blocking(uint32_t addr, uint8_t *data, size_t data_size) {
+    memcpy(data, host_psram() + addr, data_size);
+}
+
+void ice_sram_write_blocking(uint32_t addr, const uint8_t *data, size_t data_size) {
+    memcpy(host_psram() + addr, data, data_size);
+}
@@ -0,0 +1,299 @@
+/*
+ * Looper sessions on disk, through the memory-mapped PSRAM stand-in (psram_mmap.cpp, session_file.h).
+ * Built with a 256MB PSRAM image, so a track can hold a loop of over ten minutes.
+ *
+ *   record: runs the looper engine (src/looper.cpp) through a scripted first recording on track 0,
+ *           straight into a new session file, and saves it there
+ *   info:   what a session holds, and how much of its image is in the page cache
+ *   play:   reopens a session and plays every saved loop back through the engine. The loops are
+ *           paged in as the refills reach them, not copied in first; --cold evicts the image from
+ *           the page cache before opening, to see what a first play costs. Track 0's playback is
+ *           checked against its image, and --wav saves the output
+ *   export: writes a track's loop as a WAV straight from the mapping (it's already the WAV layout)
+ *
+ * usage: session record FILE [--seconds N]
+ *        session info FILE
+ *        session play FILE [--seconds N] [--cold] [--wav OUT]
+ *        session export FILE TRACK OUT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include "pico/stdlib.h"
+
+#include "auto_looper.h"
+#include "host_pico.h"
+#include "session_file.h"
+#include "wav_transfer.h"
+
+#define SAMPLE_RATE 48000
+#define TAP_US 50000 // how long the footswitch is held down for a tap
+#define MB (1024.0 * 1024.0)
+
+using bench_clock = std::chrono::steady_clock;
+
+static uint64_t sample_count = 0;
+static uint64_t release_at[NUM_TRACKS] = {};
+static uint64_t silent_until = 0; // the input is silent up to this sample
+
+static double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static int16_t input_sample() {
+    if (sample_count < silent_until) return 0;
+    double t = (double) sample_count / SAMPLE_RATE;
+    return (int16_t) (6000 * sin(2 * M_PI * 220 * t) + 3000 * sin(2 * M_PI * 331 * t));
+}
+
+static void tap(track_t& t) {
+    footswitch_changed(t, false);
+    release_at[t.id] = sample_count + (uint64_t) TAP_US * SAMPLE_RATE / 1000000;
+}
+
+// one sample through the engine, with the refills serviced straight away
+static int16_t step(int16_t input) {
+    host_time_us = sample_count * 1000000 / SAMPLE_RATE;
+    for (track_t& t : looper_ctx->tracks) {
+        if (release_at[t.id] && sample_count >= release_at[t.id]) {
+            footswitch_changed(t, true);
+            release_at[t.id] = 0;
+        }
+    }
+    int16_t output = get_next_sample(input);
+    if (looper_ctx->signal_write) service_tracks();
+    sample_count++;
+    return output;
+}
+
+static void run(double seconds) {
+    uint64_t end = sample_count + (uint64_t) (seconds * SAMPLE_RATE);
+    while (sample_count < end) step(input_sample());
+}
+
+static void init_tracks() {
+    for (uint i = 0; i < NUM_TRACKS; i++) {
+        looper_ctx->tracks[i].id = i;
+        looper_ctx->tracks[i].psram_base = psram_partition(i);
+    }
+}
+
+static void print_file_size(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return;
+    printf("file: %.1f MB, %.1f MB of it on disk (the rest is holes)\n", st.st_size / MB, st.st_blocks * 512 / MB);
+}
+
+static int do_record(const char* path, double seconds) {
+    if (seconds * SAMPLE_RATE >= PSRAM_TRACK_SAMPLES) {
+        printf("a track holds at most %.0f seconds\n", (double) PSRAM_TRACK_SAMPLES / SAMPLE_RATE);
+        return 1;
+    }
+    if (!session_open(path, true)) return 1;
+    init_tracks();
+    track_t& t = MASTER_TRACK;
+
+    auto start = bench_clock::now();
+    silent_until = SAMPLE_RATE; // a count-in, which stays holes in the file
+    tap(t);
+    run(seconds);
+    tap(t); // close the loop
+    run(1);
+    double elapsed = seconds_since(start);
+
+    if (!session_save(t)) {
+        printf("track 0 can't be saved in %s\n", state_names[t.state]);
+        session_close();
+        return 1;
+    }
+    printf("recorded a %u sample (%.1f s) loop in %.2f s (%.0fx real time)\n", t.looper.loop_length,
+           (double) t.looper.loop_length / SAMPLE_RATE, elapsed, sample_count / (double) SAMPLE_RATE / elapsed);
+    session_close();
+    print_file_size(path);
+    return 0;
+}
+
+static int do_info(const char* path) {
+    auto start = bench_clock::now();
+    if (!session_open(path, false)) return 1;
+    double open_ms = seconds_since(start) * 1000;
+
+    session_info_t* info = session_info();
+    printf("session: %u tracks, %.0f MB of PSRAM, blocks of %u samples, opened in %.3f ms\n", info->num_tracks,
+           info->psram_size_bytes / MB, info->buffer_size, open_ms);
+    for (uint i = 0; i < NUM_TRACKS; i++) {
+        const session_track_t& saved = info->tracks[i];
+        if (saved.loop_length == 0) {
+            printf("track %u: no loop\n", i);
+            continue;
+        }
+        uint blocks = (saved.loop_length + BUFFER_SIZE - 1) / BUFFER_SIZE;
+        uint silent = 0;
+        for (uint b = 0; b < blocks; b++) silent += (saved.silent[b / 32] >> (b % 32)) & 1;
+        printf("track %u: %u samples (%.1f s), %u of %u blocks silent, active region %u+%u%s\n", i, saved.loop_length,
+               (double) saved.loop_length / SAMPLE_RATE, silent, blocks, saved.active_start, saved.active_size,
+               saved.undo_mode ? " (undone)" : "");
+    }
+    printf("in the page cache: %.1f MB\n", session_resident_bytes() / MB);
+    print_file_size(path);
+    session_close();
+    return 0;
+}
+
+static int do_play(const char* path, double seconds, bool cold, const char* wav_path) {
+    if (cold) {
+        // evict whatever an earlier run left in the page cache
+        if (!session_open(path, false)) return 1;
+        session_drop_cache();
+        session_close();
+    }
+
+    auto start = bench_clock::now();
+    if (!session_open(path, false)) return 1;
+    double open_ms = seconds_since(start) * 1000;
+    size_t resident_before = session_resident_bytes();
+
+    init_tracks();
+    uint longest = 0;
+    for (track_t& t : looper_ctx->tracks) {
+        if (!session_restore(t)) continue;
+        if (t.looper.loop_length > longest) longest = t.looper.loop_length;
+        footswitch_changed(t, true); // the footswitch is up, as after a flash load
+        tap(t);                      // STOPPED to PLAYBACK1, at the next block boundary
+    }
+    if (longest == 0) {
+        printf("%s holds no loops\n", path);
+        session_close();
+        return 1;
+    }
+    if (seconds <= 0) seconds = (double) longest / SAMPLE_RATE + 1;
+
+    // check track 0 against its image while only it is playing: with silent input and unity gains,
+    // the output is its main layer (plus the active layer in the active region)
+    track_t& t = MASTER_TRACK;
+    const int16_t (*image)[2] = (const int16_t (*)[2]) (host_psram() + t.psram_base);
+    bool check = t.state == STOPPED && looper_ctx->tracks[1].state == IDLE;
+    uint64_t checked = 0, mismatches = 0;
+
+    struct rusage before_usage, after_usage;
+    getrusage(RUSAGE_SELF, &before_usage);
+    std::vector<int16_t> output;
+    uint64_t end = sample_count + (uint64_t) (seconds * SAMPLE_RATE);
+    auto render_start = bench_clock::now();
+    while (sample_count < end) {
+        looper_t& looper = t.looper;
+        bool playing = t.state == PLAYBACK1;
+        uint position = looper.buffer_start[looper.which] + looper.buffer_offset[looper.which];
+        uint loop_time = looper.loop_time;
+        bool at_loop_edge = loop_time < EDGE_FADE || loop_time + EDGE_FADE >= looper.loop_length; // faded on purpose
+        bool play_active = !looper.undo_mode && looper.in_active_region();
+
+        int16_t out = step(0);
+        output.push_back(out);
+        if (check && playing && !at_loop_edge && !looper.fallback) {
+            position %= looper.loop_length;
+            int16_t expected = add(image[position][MAIN_SAMPLE], play_active ? image[position][ACTIVE_SAMPLE] : 0);
+            if (out != expected) mismatches++;
+            checked++;
+        }
+    }
+    double render = seconds_since(render_start);
+    getrusage(RUSAGE_SELF, &after_usage);
+
+    printf("opened in %.3f ms with %.1f MB of the image in the page cache%s\n", open_ms, resident_before / MB,
+           cold ? " (evicted first)" : "");
+    printf("played %.1f s in %.3f s (%.0fx real time)\n", seconds, render, seconds / render);
+    printf("page faults while playing: %ld minor, %ld major. %.1f MB of the image in the page cache now\n",
+           after_usage.ru_minflt - before_usage.ru_minflt, after_usage.ru_majflt - before_usage.ru_majflt,
+           session_resident_bytes() / MB);
+    if (check) printf("track 0: %llu samples checked against the image, %llu differ\n", (unsigned long long) checked,
+                      (unsigned long long) mismatches);
+
+    if (wav_path) {
+        uint8_t header[WAV_HEADER_SIZE];
+        wav_format_t format = {1, 16, SAMPLE_RATE, (uint32_t) (output.size() * 2)};
+        wav_write_header(header, format);
+        FILE* f = fopen(wav_path, "wb");
+        if (!f) {
+            perror(wav_path);
+        } else {
+            fwrite(header, 1, WAV_HEADER_SIZE, f);
+            fwrite(output.data(), 2, output.size(), f);
+            fclose(f);
+        }
+    }
+    session_close();
+    return mismatches == 0 ? 0 : 1;
+}
+
+static int do_export(const char* path, uint track, const char* wav_path) {
+    if (track >= NUM_TRACKS) {
+        printf("there are only %d tracks\n", NUM_TRACKS);
+        return 1;
+    }
+    if (!session_open(path, false)) return 1;
+    uint32_t loop_length = session_info()->tracks[track].loop_length;
+    if (loop_length == 0) {
+        printf("track %u has no loop\n", track);
+        session_close();
+        return 1;
+    }
+
+    uint8_t header[WAV_HEADER_SIZE];
+    wav_format_t format = {2, 16, SAMPLE_RATE, loop_length * 4};
+    wav_write_header(header, format);
+    FILE* f = fopen(wav_path, "wb");
+    if (!f) {
+        perror(wav_path);
+        session_close();
+        return 1;
+    }
+    fwrite(header, 1, WAV_HEADER_SIZE, f);
+    fwrite(host_psram() + psram_partition(track), 4, loop_length, f);
+    fclose(f);
+    printf("wrote %u samples of track %u to %s\n", loop_length, track, wav_path);
+    session_close();
+    return 0;
+}
+
+static int usage(const char* name) {
+    printf("usage: %s record FILE [--seconds N]\n", name);
+    printf("       %s info FILE\n", name);
+    printf("       %s play FILE [--seconds N] [--cold] [--wav OUT]\n", name);
+    printf("       %s export FILE TRACK OUT\n", name);
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) return usage(argv[0]);
+    const char* command = argv[1];
+    const char* path = argv[2];
+
+    if (!strcmp(command, "export")) {
+        if (argc != 5) return usage(argv[0]);
+        return do_export(path, atoi(argv[3]), argv[4]);
+    }
+
+    double seconds = 0;
+    bool cold = false;
+    const char* wav_path = nullptr;
+    for (int i = 3; i < argc; i++) {
+        if (!strcmp(argv[i], "--seconds") && i + 1 < argc) seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--cold")) cold = true;
+        else if (!strcmp(argv[i], "--wav") && i + 1 < argc) wav_path = argv[++i];
+        else return usage(argv[0]);
+    }
+
+    if (!strcmp(command, "record")) return do_record(path, seconds > 0 ? seconds : 120);
+    if (!strcmp(command, "info")) return do_info(path);
+    if (!strcmp(command, "play")) return do_play(path, seconds, cold, wav_path);
+    return usage(argv[0]);
+}
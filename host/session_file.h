@@ -0,0 +1,63 @@
+#ifndef SESSION_FILE_H
+#define SESSION_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A looper session on disk, for the host build. The file starts with the PSRAM image exactly as the
+ * engine addresses it: track t's sample s is at psram_partition(t) + s * 4, main layer then active
+ * layer, little-endian int16 (so a track's loop is also the data of a 2 channel WAV). psram_mmap.cpp
+ * maps the file as the PSRAM stand-in, so the engine reads and writes it through the page cache and
+ * nothing is loaded up front. Blocks that were never written stay holes in the file.
+ *
+ * After the image (so on a page boundary) comes a session_info_t with what the engine keeps in SRAM
+ * and needs to play the image again, like the flash store header. A silent block's bytes are zero in
+ * a saved session, so tools reading the image don't need the silence map.
+ *
+ * Include after auto_looper.h.
+ */
+
+#define SESSION_MAGIC 0x504f4f4c // "LOOP"
+#define SESSION_VERSION 1
+
+struct session_track_t {
+    uint32_t loop_length; // samples, 0 if the track has no loop
+    uint32_t active_start;
+    uint32_t active_size;
+    uint32_t undo_mode;
+    uint32_t silent[(SILENCE_MAP_BLOCKS + 31) / 32]; // silence_map_t::silent
+};
+
+struct session_info_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t psram_size_bytes; // a session only opens in a build with the same PSRAM_SIZE_BYTES, NUM_TRACKS and BUFFER_SIZE
+    uint32_t num_tracks;
+    uint32_t buffer_size;
+    session_track_t tracks[NUM_TRACKS];
+};
+
+static_assert(sizeof(session_track_t::silent) == sizeof(silence_map_t::silent), "session silence map doesn't match the engine's");
+
+#define SESSION_FILE_BYTES (PSRAM_SIZE_BYTES + sizeof(session_info_t))
+
+// map a session file as the PSRAM stand-in. `create` starts a new, empty session in its place.
+// Returns false (and says why) if the file can't be mapped or isn't a session for this build
+bool session_open(const char* path, bool create);
+void session_close(); // writes everything back and unmaps
+session_info_t* session_info();
+
+/**
+ * Record a track's loop in the session: its loop length, active region and silence map go into the
+ * session info, and silent blocks in the loop are zeroed in the image. Same conditions as a flash
+ * save: the track must have a loop, and nothing may be waiting to be merged into it.
+*/
+bool session_save(track_t& t);
+// play the loop the session holds for an idle track: it ends up STOPPED, like after a flash load
+bool session_restore(track_t& t);
+
+size_t session_resident_bytes(); // how much of the PSRAM image is in the page cache (mincore)
+void session_drop_cache();       // write the image back and evict it, so the next pass starts cold
+
+#endif
@@ -0,0 +1,11 @@
+// host stand-in for the pico-ice-sdk PSRAM driver, see psram_ram.cpp
+#ifndef HOST_ICE_SRAM_H
+#define HOST_ICE_SRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+void ice_sram_read_blocking(uint32_t addr, uint8_t *data, size_t data_size);
+void ice_sram_write_blocking(uint32_t addr, const uint8_t *data, size_t data_size);
+
+#endif
@@ -0,0 +1,14 @@
+// host stand-in for the parts of pico/stdlib.h that src/looper.cpp uses
+#ifndef HOST_PICO_STDLIB_H
+#define HOST_PICO_STDLIB_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+uint64_t time_us_64();
+
+// each thread can run its own looper context (see looper_context_t in auto_looper.h)
+#define LOOPER_CONTEXT_LOCAL thread_local
+
+#endif
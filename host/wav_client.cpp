@@ -0,0 +1,415 @@
+/*
+ * Host side of the WAV export/import protocol (see src/wav_transfer.h).
+ *
+ * usage:
+ *   wav_client export <serial port> <track> <out.wav>
+ *   wav_client import <serial port> <track> <in.wav>
+ *   wav_client loopback [--seconds N] [--streaming]
+ *
+ * `loopback` runs a stand-in for the device on a thread, connected through a socket pair that is
+ * paced like a full-speed USB bulk endpoint (19 64-byte packets per 1ms frame each way). It runs
+ * the same wav_transfer_t bookkeeping as the firmware against a simulated PSRAM, so the protocol
+ * and its throughput can be checked without hardware. With --streaming, the device only gets one
+ * PSRAM chunk per block period, like when the looper is playing. It also checks that refused
+ * transfers are answered, and that the device gives up on a host that stops half way through.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "wav_transfer.h"
+
+#define USB_BYTES_PER_MS (19 * 64)
+#define BLOCK_PERIOD_US (WAV_BLOCK_SAMPLES * 1000000 / WAV_SAMPLE_RATE)
+
+using std::vector;
+using clock_type = std::chrono::steady_clock;
+
+static double seconds_since(clock_type::time_point start) {
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+static bool write_all(int fd, const void* data, size_t size) {
+    const uint8_t* p = (const uint8_t*) data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* data, size_t size) {
+    uint8_t* p = (uint8_t*) data;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static int open_serial(const char* path) {
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct termios tty;
+    tcgetattr(fd, &tty);
+    cfmakeraw(&tty);
+    tty.c_cc[VMIN] = 0;
+    tty.c_cc[VTIME] = 50; // a read gives up after 5 s of silence, so a device that went away isn't waited on forever
+    tcsetattr(fd, TCSANOW, &tty);
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+// find the 16 bit PCM data in a WAV file, skipping any chunks other than fmt and data
+static bool load_wav(const char* path, wav_format_t* format, vector<uint8_t>* data) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    vector<uint8_t> file;
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) file.insert(file.end(), buf, buf + n);
+    fclose(f);
+
+    if (file.size() < 12 || memcmp(&file[0], "RIFF", 4) || memcmp(&file[8], "WAVE", 4)) {
+        fprintf(stderr, "%s is not a WAV file\n", path);
+        return false;
+    }
+    bool have_format = false;
+    for (size_t pos = 12; pos + 8 <= file.size();) {
+        uint32_t size = wav_get32(&file[pos + 4]);
+        const uint8_t* body = &file[pos + 8];
+        if (pos + 8 + size > file.size()) size = file.size() - pos - 8;
+        if (!memcmp(&file[pos], "fmt ", 4) && size >= 16) {
+            if (wav_get16(body) != 1) {
+                fprintf(stderr, "%s is not PCM\n", path);
+                return false;
+            }
+            format->channels = wav_get16(body + 2);
+            format->sample_rate = wav_get32(body + 4);
+            format->bits = wav_get16(body + 14);
+            have_format = true;
+        } else if (!memcmp(&file[pos], "data", 4) && have_format) {
+            data->assign(body, body + size);
+            format->data_size = size;
+            return true;
+        }
+        pos += 8 + size + (size & 1);
+    }
+    fprintf(stderr, "%s has no audio data\n", path);
+    return false;
+}
+
+static bool save_wav(const char* path, const uint8_t* header, const vector<uint8_t>& data) {
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    fwrite(header, 1, WAV_HEADER_SIZE, f);
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+    return true;
+}
+
+// wait for the device's next reply. Any console text in front of it is skipped
+static bool read_reply(int fd, uint8_t* code) {
+    const char* mark = WAV_REPLY_MARK;
+    int matched = 0;
+    while (matched < WAV_REPLY_MARK_SIZE) {
+        uint8_t c;
+        if (!read_all(fd, &c, 1)) return false;
+        matched = c == (uint8_t) mark[matched] ? matched + 1 : (c == (uint8_t) mark[0] ? 1 : 0);
+    }
+    return read_all(fd, code, 1);
+}
+
+// ask for an export and read the WAV that comes back
+static bool do_export(int fd, int track, uint8_t* header, vector<uint8_t>* data) {
+    char command[2] = {(char)('0' + track), 'e'};
+    if (!write_all(fd, command, 2)) return false;
+
+    uint8_t reply;
+    if (!read_reply(fd, &reply)) return false;
+    if (reply != WAV_ACCEPTED) {
+        fprintf(stderr, "device can't export track %d (no loop, or it's busy)\n", track);
+        return false;
+    }
+    if (!read_all(fd, header, WAV_HEADER_SIZE)) return false;
+
+    wav_format_t format;
+    if (!wav_parse_header(header, &format)) {
+        fprintf(stderr, "device sent a bad WAV header\n");
+        return false;
+    }
+    data->resize(format.data_size);
+    return read_all(fd, data->data(), data->size());
+}
+
+// the header only goes out once the device has taken the command, or the console would read it as commands
+static bool do_import(int fd, int track, const wav_format_t& format, const vector<uint8_t>& data) {
+    uint8_t header[WAV_HEADER_SIZE];
+    wav_write_header(header, format);
+    char command[2] = {(char)('0' + track), 'i'};
+    if (!write_all(fd, command, 2)) return false;
+
+    uint8_t reply;
+    if (!read_reply(fd, &reply)) return false;
+    if (reply != WAV_ACCEPTED) {
+        fprintf(stderr, "device can't import into track %d (it isn't idle)\n", track);
+        return false;
+    }
+    if (!write_all(fd, header, sizeof(header)) || !read_reply(fd, &reply)) return false;
+    if (reply != WAV_ACCEPTED) {
+        fprintf(stderr, "device rejected the WAV (needs 16 bit, 1 or 2 channels, %d Hz, and to fit in PSRAM)\n", WAV_SAMPLE_RATE);
+        return false;
+    }
+    if (!write_all(fd, data.data(), data.size())) return false;
+    return read_reply(fd, &reply) && reply == WAV_DONE;
+}
+
+/**
+ * Stand-in for the firmware's poll_console/poll_wav_transfer, talking over `fd` at full-speed
+ * USB rates. PSRAM is a plain vector here, and only track 0 has a loop (or takes one); the device
+ * refuses transfers for any other track.
+*/
+struct loopback_device_t {
+    int fd;
+    bool streaming;
+    vector<uint8_t> psram;
+    uint32_t loop_length;
+    uint32_t track = 0;
+    wav_transfer_t transfer;
+    std::atomic<bool> stop{false};
+    std::atomic<int> aborted{0}; // transfers given up on
+
+    void refuse() {
+        uint8_t reply[WAV_REPLY_SIZE];
+        wav_write_reply(reply, WAV_REJECTED);
+        write_all(fd, reply, sizeof(reply));
+    }
+
+    void run() {
+        auto start = clock_type::now();
+        long long frame = -1;
+        long long block = -1;
+        uint32_t tx_budget = 0, rx_budget = 0;
+        bool window = true;
+
+        while (!stop) {
+            long long us = std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - start).count();
+            if (us / 1000 != frame) {
+                frame = us / 1000;
+                tx_budget = rx_budget = USB_BYTES_PER_MS;
+            }
+            if (us / BLOCK_PERIOD_US != block) {
+                block = us / BLOCK_PERIOD_US;
+                window = true;
+            }
+
+            if (!transfer.busy()) {
+                uint8_t c;
+                if (read(fd, &c, 1) != 1) continue;
+                if (c >= '0' && c <= '9') track = c - '0';
+                else if (c == 'e' && (track != 0 || !transfer.begin_export(track, loop_length))) refuse();
+                else if (c == 'i' && (track != 0 || !transfer.begin_import(track, psram.size() / 4))) refuse();
+                continue;
+            }
+
+            bool moved = false;
+            uint32_t size;
+            const uint8_t* out = transfer.pending_output(&size);
+            if (size > tx_budget) size = tx_budget;
+            if (size > 0) {
+                ssize_t n = write(fd, out, size);
+                if (n > 0) {
+                    tx_budget -= n;
+                    transfer.output_sent(n);
+                    moved = true;
+                }
+            }
+
+            uint32_t room;
+            uint8_t* in = transfer.input_dest(&room);
+            if (room > rx_budget) room = rx_budget;
+            if (room > 0) {
+                ssize_t n = read(fd, in, room);
+                if (n > 0) {
+                    rx_budget -= n;
+                    transfer.input_received(n);
+                    moved = true;
+                }
+            }
+
+            uint32_t start_sample;
+            if (!streaming || window) {
+                uint32_t count = transfer.job == WAV_JOB_EXPORT ? transfer.next_export_read(&start_sample) : transfer.next_import_write(&start_sample);
+                if (count > 0) {
+                    window = false;
+                    moved = true;
+                    if (transfer.job == WAV_JOB_EXPORT) {
+                        memcpy(transfer.block, &psram[start_sample * 4], count * 4);
+                        transfer.export_read_done(count);
+                    } else {
+                        memcpy(&psram[start_sample * 4], transfer.block, count * 4);
+                        transfer.import_write_done(count);
+                    }
+                }
+            }
+            if (transfer.busy() && transfer.stalled(us, moved)) {
+                transfer.abort();
+                aborted++;
+                continue;
+            }
+            if (transfer.job == WAV_JOB_IMPORT && transfer.ok && !transfer.busy()) {
+                loop_length = transfer.loop_length;
+            }
+        }
+    }
+};
+
+static int loopback(double seconds, bool streaming) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    loopback_device_t device;
+    device.fd = fds[1];
+    device.streaming = streaming;
+    device.loop_length = (uint32_t)(seconds * WAV_SAMPLE_RATE);
+    device.psram.resize(device.loop_length * 4);
+    srand(1);
+    for (uint32_t i = 0; i < device.loop_length; i++) {
+        int16_t main = rand() % 20000 - 10000;
+        memcpy(&device.psram[i * 4], &main, 2); // active layer stays silent, so an import round trips exactly
+    }
+    vector<uint8_t> original = device.psram;
+    std::thread thread([&] { device.run(); });
+
+    printf("loop: %u samples (%.1f s), %s\n", device.loop_length, seconds, streaming ? "looper streaming" : "looper idle");
+
+    uint8_t header[WAV_HEADER_SIZE];
+    vector<uint8_t> data;
+    auto start = clock_type::now();
+    bool exported = do_export(fds[0], 0, header, &data);
+    double export_time = seconds_since(start);
+    exported = exported && data == original;
+
+    std::fill(device.psram.begin(), device.psram.end(), 0);
+    wav_format_t format;
+    wav_parse_header(header, &format);
+    start = clock_type::now();
+    bool imported = do_import(fds[0], 0, format, data);
+    double import_time = seconds_since(start);
+    imported = imported && device.psram == original;
+
+    // a refused export or import is answered, instead of leaving the host waiting
+    vector<uint8_t> refused_data;
+    bool refusals = !do_export(fds[0], 1, header, &refused_data) && !do_import(fds[0], 1, format, data);
+
+    // a host that stops half way through an import: the device gives up and takes commands again
+    const char command[2] = {'0', 'i'};
+    uint8_t reply;
+    bool recovered = write_all(fds[0], command, 2) && read_reply(fds[0], &reply) && reply == WAV_ACCEPTED
+        && write_all(fds[0], header, WAV_HEADER_SIZE) && read_reply(fds[0], &reply) && reply == WAV_ACCEPTED
+        && write_all(fds[0], data.data(), data.size() / 2);
+    start = clock_type::now();
+    while (recovered && device.aborted == 0 && seconds_since(start) < 2 * WAV_TIMEOUT_US / 1e6) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    double abort_time = seconds_since(start);
+    recovered = recovered && device.aborted == 1 && do_export(fds[0], 0, header, &refused_data) && refused_data == original;
+
+    device.stop = true;
+    thread.join();
+    close(fds[0]);
+    close(fds[1]);
+
+    double bytes = original.size();
+    double usb_max = USB_BYTES_PER_MS * 1000.0;
+    printf("export: %.2f s, %.0f KB/s (%.0f%% of full-speed bulk) %s\n", export_time, bytes / export_time / 1024,
+           100 * bytes / export_time / usb_max, exported ? "ok" : "MISMATCH");
+    printf("import: %.2f s, %.0f KB/s (%.0f%% of full-speed bulk) %s\n", import_time, bytes / import_time / 1024,
+           100 * bytes / import_time / usb_max, imported ? "ok" : "MISMATCH");
+    printf("refused transfers answered: %s\n", refusals ? "ok" : "NO");
+    printf("host gone half way through an import: device gave up after %.1f s %s\n", abort_time,
+           recovered ? "and took the next export" : "FAILED");
+    printf("device SRAM used for staging: %zu bytes\n", sizeof(device.transfer.block));
+    return exported && imported && refusals && recovered ? 0 : 1;
+}
+
+static int usage(const char* name) {
+    fprintf(stderr, "usage: %s export <port> <track> <out.wav>\n", name);
+    fprintf(stderr, "       %s import <port> <track> <in.wav>\n", name);
+    fprintf(stderr, "       %s loopback [--seconds N] [--streaming]\n", name);
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) return usage(argv[0]);
+
+    if (!strcmp(argv[1], "loopback")) {
+        double seconds = 5;
+        bool streaming = false;
+        for (int i = 2; i < argc; i++) {
+            if (!strcmp(argv[i], "--seconds") && i + 1 < argc) seconds = atof(argv[++i]);
+            else if (!strcmp(argv[i], "--streaming")) streaming = true;
+            else return usage(argv[0]);
+        }
+        return loopback(seconds, streaming);
+    }
+
+    if (argc != 5) return usage(argv[0]);
+    int track = atoi(argv[3]);
+    int fd = open_serial(argv[2]);
+    if (fd < 0) return 1;
+
+    auto start = clock_type::now();
+    bool ok;
+    size_t bytes = 0;
+    if (!strcmp(argv[1], "export")) {
+        uint8_t header[WAV_HEADER_SIZE];
+        vector<uint8_t> data;
+        ok = do_export(fd, track, header, &data) && save_wav(argv[4], header, data);
+        bytes = data.size();
+    } else if (!strcmp(argv[1], "import")) {
+        wav_format_t format;
+        vector<uint8_t> data;
+        ok = load_wav(argv[4], &format, &data) && do_import(fd, track, format, data);
+        bytes = data.size();
+    } else {
+        close(fd);
+        return usage(argv[0]);
+    }
+    close(fd);
+
+    double elapsed = seconds_since(start);
+    if (ok) printf("%zu bytes in %.2f s (%.0f KB/s)\n", bytes, elapsed, bytes / elapsed / 1024);
+    else fprintf(stderr, "transfer failed\n");
+    return ok ? 0 : 1;
+}
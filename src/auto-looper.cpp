@@ -1,5 +1,7 @@
 #include "hardware/clocks.h"
 #include "hardware/dma.h"
+#include "hardware/flash.h"
+#include "hardware/irq.h"
 #include "hardware/pio.h"
 #include "pico/stdlib.h"
 
@@ -8,46 +10,32 @@
 #include "pico/stdlib.h"
 
 // tinyusb
+#include "pico/stdio_usb.h"
 #include "tusb.h"
 
 #include "button.h"
 #include "i2s.h"
 
 #include "auto_looper.h"
+#include "flash_store.h"
+#include "sys_clock.h"
+#include "wav_transfer.h"
 
-#define FOOTSWITCH_PIN 6 // The footswitch pin
+#define FOOTSWITCH_PINS {6, 7} // One footswitch pin per track. The first track is the master
 
-looper_t looper;
-
-#define PSRAM_ACCESS_BUFFER (!looper.which)   // the buffer that is read from and then written to by PSRAM
-#define LOOP_BUFFER (looper.which)            // the buffer that is used for looping by the CPU
+static __attribute__((aligned(8))) pio_i2s i2s; // i2s instance
 
-// used to tell the main loop to write to PSRAM and then read from it
-volatile bool signal_write = false; 
-volatile uint read_location = 0;
+// The audio IRQ preempts everything else, so the button sampling IRQ (and USB) can't delay it
+#define AUDIO_IRQ_PRIORITY PICO_HIGHEST_IRQ_PRIORITY
+static_assert(BUTTON_IRQ_PRIORITY > AUDIO_IRQ_PRIORITY, "button IRQ must have a lower priority than audio");
 
-static __attribute__((aligned(8))) pio_i2s i2s; // i2s instance
+// time between audio IRQs, to measure how much jitter everything else adds to the audio path
+volatile uint32_t isr_last_us = 0;
+volatile uint32_t isr_min_period_us = UINT32_MAX;
+volatile uint32_t isr_max_period_us = 0;
 
-enum state_t { 
-    IDLE, 
-    FIRST_RECORD, FIRST_TMP_RECORD, TEMP_RECORD, RECORD, 
-    FIRST_PLAYBACK, PLAY, PLAYBACK1,
-    FIRST_STOP, STOPPED 
-};
-
-// used for debugging
-const char* state_names[] = {
-    "IDLE", 
-    "FIRST_RECORD", "FIRST_TMP_RECORD", "TEMP_RECORD", "RECORD", 
-    "FIRST_PLAYBACK", "PLAY", "PLAYBACK1",
-    "FIRST_STOP", "STOPPED"
-};
-
-// state machine variables
-bool button_released = true;
-bool button_pressed = false;
-uint64_t last_time = 0;
-state_t state = IDLE;
+flash_store_t flash_store(FLASH_STORE_REGION_SIZE);
+wav_transfer_t wav_transfer;
 
 // TODO: stop using PSRAM for short loop lengths. Minimum loop length right now is BUFFER_SIZE
 
@@ -64,6 +52,13 @@ static void process_audio(const int32_t* input, int32_t* output, size_t num_fram
 
 static void dma_i2s_in_handler(void) {
         dma_hw->ints0 = 1u << i2s.dma_ch_in_data;  // clear the IRQ
+
+    uint32_t now = time_us_32();
+    uint32_t period = now - isr_last_us;
+    isr_last_us = now;
+    if (period < isr_min_period_us) isr_min_period_us = period;
+    if (period > isr_max_period_us) isr_max_period_us = period;
+
     /* We're double buffering using chained TCBs. By checking which buffer the
      * DMA is currently reading from, we can identify which buffer it has just
      * finished reading (the completion of which has triggered this interrupt).
@@ -77,79 +72,6 @@ static void dma_i2s_in_handler(void) {
     }
 }
 
-void write_routine() {
-    uint write_size = looper.buffer_offset[PSRAM_ACCESS_BUFFER];
-    uint write_location = looper.buffer_start[PSRAM_ACCESS_BUFFER];
-    /*if (sample_num + num_write > loop_length) {
-        uint write_size_one = loop_length - sample_num;
-        uint write_size_two = num_write - write_size_one;
-        uint32_t psram_size_one = write_size_one * 2;
-        uint32_t psram_size_two = write_size_two * 2;
-        uint32_t psram_address_one = sample_num * 2;
-        uint32_t psram_address_two = 0;
-        // printf("Writing to address %d, var which is %d, writing %d samples\n", psram_address_one/2, which, write_size_one);
-        ice_sram_write_blocking(psram_address_one, (uint8_t*) ram_buffer[PSRAM_ACCESS_BUFFER], psram_size_one);
-        // printf("Also writing to address %d, writing %d samples\n", psram_address_two/2, write_size_two);
-        ice_sram_write_blocking(psram_address_two, (uint8_t*) ram_buffer[PSRAM_ACCESS_BUFFER][write_size_one], psram_size_two);
-    } else*/ {
-        uint32_t psram_address = write_location * 4;
-        uint32_t psram_write_size = write_size * 4;
-        //printf("Writing to address %d, var which is %d, writing %d samples\n", psram_address/2, which, write_size);
-        ice_sram_write_blocking(psram_address, (uint8_t*) looper.buffer[PSRAM_ACCESS_BUFFER], psram_write_size);// write_callback, NULL);
-    }
-
-    // TODO: read scratch buffer if needed, using old active buffer as well!
-    if (looper.scratch_buffer_size == SCRATCH_BUFFER_SIZE) {
-        // read from psram, mix with scratch buffer, write back to psram.
-        // also mix active buffer into main buffer if old active buffer is not empty
-        uint start_time = looper.scratch_buffer_start + looper.scratch_buffer_ptr;
-        uint32_t psram_address = start_time * 4;
-        uint32_t psram_rw_size = BUFFER_SIZE * 4;
-        //printf("Reading from address %d, var which is %d\n", psram_address/2, which);
-        ice_sram_read_blocking(psram_address, (uint8_t*) looper.buffer[PSRAM_ACCESS_BUFFER], psram_rw_size);// read_callback, NULL);
-
-        for (int i = 0; i < BUFFER_SIZE; i++) {
-            if (looper.in_old_active_region(start_time + i)) { // TODO: check old active region logic
-                // mix active buffer into main buffer
-                looper.buffer[PSRAM_ACCESS_BUFFER][i][MAIN_SAMPLE] = add(looper.buffer[PSRAM_ACCESS_BUFFER][i][MAIN_SAMPLE], looper.buffer[PSRAM_ACCESS_BUFFER][i][ACTIVE_SAMPLE]);
-            }
-            // mix scratch buffer into active buffer
-            looper.buffer[PSRAM_ACCESS_BUFFER][i][ACTIVE_SAMPLE] = looper.scratch_buffer[looper.scratch_buffer_ptr + i];
-        }
-
-        // write back to psram
-        ice_sram_write_blocking(psram_address, (uint8_t*) looper.buffer[PSRAM_ACCESS_BUFFER], psram_rw_size);// write_callback, NULL);
-
-        looper.scratch_buffer_ptr += BUFFER_SIZE;
-        if (looper.scratch_buffer_ptr >= looper.scratch_buffer_size) {
-            looper.scratch_buffer_size = 0;
-            looper.scratch_buffer_ptr = 0;
-            printf("Finished writing scratch buffer\n");
-        }
-    }
-
-    looper.buffer_offset[PSRAM_ACCESS_BUFFER] = 0;
-    looper.buffer_start[PSRAM_ACCESS_BUFFER] = read_location;
-    /*if (sample_num + BUFFER_SIZE > loop_length) {
-        uint read_size_one = loop_length - sample_num;
-        uint read_size_two = BUFFER_SIZE - read_size_one;
-        uint32_t psram_size_one = read_size_one * 2;
-        uint32_t psram_size_two = read_size_two * 2;
-        uint32_t psram_address_one = sample_num * 2;
-        uint32_t psram_address_two = 0;
-        // printf("Reading from address %d, var which is %d\n", psram_address_one/2, which);
-        ice_sram_read_blocking(psram_address_one, (uint8_t*) ram_buffer[PSRAM_ACCESS_BUFFER], psram_size_one);
-        // printf("Also reading from address %d, reading %d samples\n", psram_address_two/2, read_size_two);
-        ice_sram_read_blocking(psram_address_two, (uint8_t*) ram_buffer[PSRAM_ACCESS_BUFFER][read_size_one], psram_size_two);
-    } else*/ {
-        uint32_t psram_address = read_location * 4;
-        uint32_t psram_write_size = BUFFER_SIZE * 4;
-        //printf("Reading from address %d, var which is %d\n", psram_address/2, which);
-        ice_sram_read_blocking(psram_address, (uint8_t*) looper.buffer[PSRAM_ACCESS_BUFFER], psram_write_size);// read_callback, NULL);
-    }
-    signal_write = false;
-}
-
 /**
  * @brief Called when the footswitch is pressed or released.
 */
@@ -157,253 +79,400 @@ void footswitch_onchange(button_t *button_p) {
     button_t *button = (button_t*)button_p;
     //printf("Button on pin %d changed its state to %d\n", button->pin, button->state);
 
-    if (button->state) {
-        button_released = true;
-        button_pressed = false;
-    } else {
-        button_pressed = true;
+    static const uint footswitch_pins[NUM_TRACKS] = FOOTSWITCH_PINS;
+    for (track_t& t : looper_ctx->tracks) {
+        if (footswitch_pins[t.id] == button->pin) {
+            // a press can start a recording, which needs PSRAM at full speed from the next block on
+            sys_clock_full();
+            footswitch_changed(t, button->state);
+        }
     }
 }
 
-void reset_button() {
-    button_released = false;
-    button_pressed = false;
-    last_time = time_us_64();
-}
-
-inline bool time_up() {
-    return time_us_64() - last_time > 660000;
-}
+/**
+ * Start saving a track's loop to flash in the background. Only loops without any pending
+ * overdub merges can be saved, since those only live in the active layer until they are committed,
+ * and only once every change is in PSRAM. If the loop is written to before all of it has been read
+ * (a new overdub, say), the save is abandoned rather than storing a mix of before and after.
+*/
+void save_loop(track_t& t) {
+    looper_t& looper = t.looper;
+    if (t.state == IDLE || t.state == FIRST_RECORD || t.state == RECORD || looper.scratch_buffer_size != 0
+        || !looper.old_active_start.empty() || looper.dirty[0] || looper.dirty[1]) {
+        printf("Track %d can't be saved right now\n", t.id);
+        return;
+    }
 
-// for debugging
-inline const char* get_state_type(state_t state) {
-    if (state == 0) return "Waiting";
-    if (state >= 1 && state <= 4) return "Recording";
-    if (state >= 5 && state <= 7) return "Playing";
-    if (state >= 8 && state <= 9) return "Stopped";
-    return "Unknown";
+    flash_store_header_t header = {};
+    header.loop_length = looper.loop_length;
+    header.active_start = looper.active_start;
+    header.active_size = looper.active_size;
+    header.undo_mode = looper.undo_mode;
+    if (!flash_store.begin_save(t.id, header)) {
+        printf("Can't save track %d (loop too long or a save/load is running)\n", t.id);
+        return;
+    }
+    t.saving = true;
+    printf("Saving track %d to flash\n", t.id);
 }
 
-inline void update_state(state_t new_state) {
-    state = new_state;
-
-    if (state == IDLE) {
-        looper = looper_t(); // reset the looper
+// start copying the saved loop into an idle track in the background
+void load_loop(track_t& t) {
+    // flash can't be read while core1 is erasing or programming it
+    if (t.state != IDLE || flash_store.busy()) {
+        printf("Can't load a loop into track %d\n", t.id);
+        return;
     }
-
-    if (state == RECORD) {
-        if (looper.undo_mode) {
-            // we don't need to save the old active region, so we can just overwrite it
-            looper.set_undo_mode(false);
-        } else {
-            // mark the old active region for writing
-            looper.add_old_active_region(looper.active_start, looper.active_size);
-        }
-
-        if (looper.scratch_buffer_size != SCRATCH_BUFFER_SIZE) {
-            printf("Error: scratch buffer not full\n");
-        }
-        looper.active_start = (looper.loop_time - looper.scratch_buffer_size + looper.loop_length) % looper.loop_length;
-        looper.active_size = looper.scratch_buffer_size;
-
-        printf("New active region: %d, %d\n", looper.active_start, looper.active_size);
+    flash_store_header_t header;
+    memcpy(&header, flash_store_data(), sizeof(header));
+    if (!flash_store.begin_load(t.id, header)) {
+        printf("Can't load a loop into track %d\n", t.id);
+        return;
     }
+    t.loading = true;
+    t.saving = false;
+    printf("Loading track %d from flash\n", t.id);
+}
 
-    if (state == FIRST_TMP_RECORD || state == TEMP_RECORD) {
-        // reset the scratch buffer
-        looper.scratch_buffer_start = looper.loop_time;
-        looper.scratch_buffer_size = 0;
-        looper.scratch_buffer_ptr = 0;
+static void finish_load(track_t& t) {
+    looper_t& looper = t.looper;
+    if (!flash_store.load_ok()) {
+        printf("Saved loop is corrupt, not loading it\n");
+        t.loading = false;
+        return;
     }
 
-    reset_button();
-    printf("State changed to %s\n", state_names[state]);
-    printf("Current status: %s\n\n", get_state_type(state));
+    looper.loop_length = flash_store.header.loop_length;
+    looper.active_start = flash_store.header.active_start;
+    looper.active_size = flash_store.header.active_size;
+    looper.undo_mode = flash_store.header.undo_mode;
+    start_stopped(t);
+    printf("Loaded a %d sample loop into track %d\n", looper.loop_length, t.id);
 }
 
-int16_t get_next_sample(int16_t current) {
+/**
+ * True while the loop a save started from is still the one in the track: nothing has been written
+ * to it, and it hasn't been cleared, re-recorded, overdubbed or replaced by a load or import.
+*/
+static bool save_still_valid(track_t& t) {
+    state_t state = t.state;
+    return t.saving && state != IDLE && state != FIRST_RECORD && state != RECORD && !t.loading;
+}
 
-    if (state == IDLE) {
-        if (button_pressed && button_released) {
-            update_state(FIRST_RECORD);
-        }
+// move one chunk between PSRAM and flash. Erasing and programming happen on core1
+void poll_flash_store() {
+    flash_sector_t* written = flash_store_poll();
+    if (written && flash_store.sector_written(written)) {
+        looper_ctx->tracks[flash_store.track].saving = false;
+        printf("Saved track %d to flash\n", flash_store.track);
     }
-
-    if (state == FIRST_RECORD) {
-        if (button_pressed && button_released) {
-            looper.loop_length = (looper.loop_length / BUFFER_SIZE) * BUFFER_SIZE; // TODO: tmp
-            printf("Loop length: %d\n\n", looper.loop_length);
-            update_state(FIRST_PLAYBACK);
-        }
+    flash_sector_t* ready = flash_store.ready_sector();
+    if (ready && flash_store_submit(ready)) {
+        flash_store.sector_submitted(ready);
     }
 
-    if (state == FIRST_PLAYBACK) {
-        if (button_pressed && button_released) {
-            if (time_up()) {
-                update_state(FIRST_TMP_RECORD);
-            } else {
-                update_state(FIRST_STOP);
-            }
-        } else if (!button_released && time_up()) {
-            update_state(IDLE);
-        }
+    track_t& t = looper_ctx->tracks[flash_store.track];
+    if (flash_store.job == FLASH_JOB_SAVE && !save_still_valid(t) && flash_store.abort_save()) {
+        printf("Track %d changed while it was being saved, save abandoned (flash holds no loop now)\n", t.id);
     }
 
-    if (state == FIRST_STOP) {
-        if (button_pressed && button_released) {
-            update_state(FIRST_PLAYBACK);
-        } else if (button_released) {
+    if (!take_psram_window()) return;
 
-        } else if (time_up()) {
-            update_state(IDLE);
+    uint32_t start;
+    if (flash_store.job == FLASH_JOB_SAVE) {
+        uint8_t* dest;
+        uint32_t count = flash_store.next_save_chunk(&start, &dest);
+        if (count > 0) {
+            psram_transfer(t, start, (int16_t (*)[2]) dest, count, false);
+            flash_store.save_chunk_done(count);
+        }
+    } else if (flash_store.job == FLASH_JOB_LOAD) {
+        uint32_t flash_offset;
+        uint32_t count = flash_store.next_load_chunk(&start, &flash_offset);
+        const uint8_t* src = flash_store_data() + flash_offset;
+        psram_transfer(t, start, (int16_t (*)[2]) src, count, true);
+        if (flash_store.load_chunk_done(src, count)) {
+            finish_load(t);
         }
     }
+}
 
-    if (state == FIRST_TMP_RECORD) {
-        bool done = looper.scratch_buffer_size >= SCRATCH_BUFFER_SIZE;
-        if (!button_pressed && !button_released && done) {
-            // invalidate tmp buffer
-            update_state(IDLE);
-        } else if (button_pressed && button_released && !done) {
-            // invalidate tmp buffer
-            update_state(STOPPED);
-        } else if (done) {
-            update_state(RECORD);
-        }
+// fast boot: restore the saved loop into the master track before anything else uses the PSRAM
+void restore_on_boot() {
+    flash_store_header_t header;
+    memcpy(&header, flash_store_data(), sizeof(header));
+    if (!flash_store.header_valid(header)) return;
+
+    load_loop(MASTER_TRACK);
+    while (flash_store.job == FLASH_JOB_LOAD) {
+        poll_flash_store();
     }
+}
 
-    if (state == RECORD) {
-        // scratch buffer must be flushed before finishing recording
-        if (button_pressed && looper.scratch_buffer_size == 0/* && button_released*/) {
-            update_state(PLAY);
-        }
+// tell the host a transfer it asked for isn't going to happen, so it doesn't wait for one
+static void refuse_wav_transfer() {
+    uint8_t reply[WAV_REPLY_SIZE];
+    wav_write_reply(reply, WAV_REJECTED);
+    tud_cdc_write(reply, sizeof(reply));
+    tud_cdc_write_flush();
+}
+
+/**
+ * Start sending a track's loop to the host as a WAV. The serial console is switched off for the
+ * duration, so debug output can't end up in the middle of the file.
+*/
+void begin_wav_export(track_t& t) {
+    bool has_loop = t.state != IDLE && t.state != FIRST_RECORD && !t.loading;
+    if (!has_loop || !wav_transfer.begin_export(t.id, t.looper.loop_length)) {
+        printf("Track %d can't be exported right now\n", t.id);
+        refuse_wav_transfer();
+        return;
     }
+    stdio_set_driver_enabled(&stdio_usb, false);
+}
 
-    if (state == PLAY) {
-        if (button_pressed /* && button_released*/) {
-            if (time_up()) {
-                update_state(TEMP_RECORD);
-            } else {
-                update_state(STOPPED);
-            }
-        } else if (!button_released && time_up()) {
-            // undo
-            looper.set_undo_mode(true);
-            reset_button();
-        }
+// start receiving a WAV from the host into an idle track
+void begin_wav_import(track_t& t) {
+    if (t.state != IDLE || t.loading || !wav_transfer.begin_import(t.id, PSRAM_TRACK_SAMPLES)) {
+        printf("Track %d can't be imported right now\n", t.id);
+        refuse_wav_transfer();
+        return;
     }
+    t.loading = true;
+    t.saving = false;
+    stdio_set_driver_enabled(&stdio_usb, false);
+}
 
-    if (state == TEMP_RECORD) {
-        bool done = looper.scratch_buffer_size >= SCRATCH_BUFFER_SIZE;
-        if (!button_pressed && !button_released && done) {
-            // invalidate tmp buffer
-            looper.set_undo_mode(!looper.undo_mode);
-            update_state(PLAY);
-        } else if (button_pressed && button_released && !done) {
-            // invalidate tmp buffer
-            update_state(STOPPED);
-        } else if (done) {
-            update_state(RECORD);
-        }
+/**
+ * Move WAV data between USB and the staging block, and between the staging block and PSRAM.
+ * Only one block is ever held in SRAM, whatever the loop length. If the host closes the port or
+ * stops moving data, the transfer is aborted and the console comes back.
+*/
+void poll_wav_transfer() {
+    bool moved = false;
+    uint32_t size;
+    const uint8_t* out = wav_transfer.pending_output(&size);
+    if (size > 0) {
+        uint32_t available = tud_cdc_write_available();
+        uint32_t sent = tud_cdc_write(out, size < available ? size : available);
+        tud_cdc_write_flush();
+        wav_transfer.output_sent(sent);
+        moved |= sent > 0;
     }
 
-    if (state == STOPPED) {
-        if (button_pressed && button_released) {
-            update_state(PLAYBACK1);
-        } else if (!button_released && time_up()) {
-            update_state(IDLE);
-        }
+    uint32_t room;
+    uint8_t* in = wav_transfer.input_dest(&room);
+    if (room > 0 && tud_cdc_available()) {
+        uint32_t received = tud_cdc_read(in, room);
+        wav_transfer.input_received(received);
+        moved |= received > 0;
     }
 
-    if (state == PLAYBACK1) {
-        if (button_released && button_pressed && !time_up()) {
-            update_state(STOPPED);
-        } else if (!button_released && time_up()) {
-            update_state(IDLE);
-        } else if (button_released && button_pressed /*&& time_up() implied*/) {
-            update_state(TEMP_RECORD);
+    track_t& t = looper_ctx->tracks[wav_transfer.track];
+    uint32_t start;
+    uint32_t count = wav_transfer.job == WAV_JOB_EXPORT ? wav_transfer.next_export_read(&start) : wav_transfer.next_import_write(&start);
+    if (count > 0 && take_psram_window()) {
+        if (wav_transfer.job == WAV_JOB_EXPORT) {
+            psram_transfer(t, start, wav_transfer.block, count, false);
+            wav_transfer.export_read_done(count);
+        } else {
+            psram_transfer(t, start, wav_transfer.block, count, true);
+            wav_transfer.import_write_done(count);
         }
+        moved = true;
     }
 
-    // old code below
-    // add the current and looped values together, then write back
-    uint index = 0;
-    if (state != IDLE && state != STOPPED && state != FIRST_STOP) {
-        index = looper.buffer_offset[LOOP_BUFFER]++;
+    bool stalled = wav_transfer.stalled(time_us_64(), moved);
+    if (wav_transfer.busy() && (stalled || !tud_cdc_connected())) {
+        wav_transfer.abort();
+        tud_cdc_write_clear(); // whatever is left of it would only confuse the next transfer
+        tud_cdc_read_flush();
+        stdio_set_driver_enabled(&stdio_usb, true);
+        printf("WAV transfer for track %d aborted, the host went away\n", t.id);
     }
 
-    if (state == IDLE || state == STOPPED || state == FIRST_STOP) { 
-        return current; // we're done
+    if (wav_transfer.busy()) return;
+    stdio_set_driver_enabled(&stdio_usb, true);
+    if (t.loading) {
+        if (wav_transfer.ok) {
+            t.looper.loop_length = (wav_transfer.loop_length / BUFFER_SIZE) * BUFFER_SIZE;
+        }
+        if (t.looper.loop_length > 0) {
+            start_stopped(t);
+            printf("Imported a %d sample loop into track %d\n", t.looper.loop_length, t.id);
+        } else {
+            t.loading = false;
+            printf("Import into track %d failed\n", t.id);
+        }
     }
+}
 
-    int16_t mixed = current;
+/**
+ * Print how regular the audio IRQ has been since the last call, and what the button sampling cost.
+ * Bouncing contacts don't generate interrupts any more and the sampling IRQ can't preempt the audio
+ * IRQ, so the jitter should be the same with a footswitch being hammered as with none at all.
+*/
+void print_jitter() {
+    uint32_t saved = save_and_disable_interrupts();
+    uint32_t min_period = isr_min_period_us;
+    uint32_t max_period = isr_max_period_us;
+    isr_min_period_us = UINT32_MAX;
+    isr_max_period_us = 0;
+    restore_interrupts(saved);
+
+    button_stats_t stats = button_take_stats();
+    printf("Audio IRQ period: %d to %d us (jitter %d us)\n", min_period, max_period, max_period - min_period);
+    printf("Button sampling: %d samples, longest %d us, %d raw edges\n", stats.samples, stats.max_sample_us, stats.edges);
+}
 
-    bool in_old_active_region = looper.in_old_active_region();
-    uint16_t main = looper.buffer[LOOP_BUFFER][index][MAIN_SAMPLE];
-    uint16_t active = looper.buffer[LOOP_BUFFER][index][ACTIVE_SAMPLE];
+void print_psram_stats() {
+    uint32_t saved = save_and_disable_interrupts();
+    psram_stats_t stats = looper_ctx->psram_stats;
+    looper_ctx->psram_stats = {};
+    restore_interrupts(saved);
+
+    uint32_t swaps = stats.writebacks + stats.writebacks_skipped;
+    printf("PSRAM: %d bytes read, %d bytes written\n", stats.bytes_read, stats.bytes_written);
+    printf("Block write-backs: %d of %d (%d skipped, clean)\n", stats.writebacks, swaps, stats.writebacks_skipped);
+    printf("Silent blocks left out: %d, loop head reads: %d\n", stats.silent_skipped, stats.head_hits);
+    printf("Refill overruns: %d (%d blocks played from the fallback)\n", stats.overruns, stats.fallback_blocks);
+}
 
-    if ((!looper.undo_mode && looper.in_active_region()) || in_old_active_region) { // TODO: check this line more carefully
-        // we're in the active region, so we need to mix the current sample with the active sample
-        mixed = add(mixed, active);
-    }
-    if (state != FIRST_RECORD) {
-        // we're not in the first record state, so we need to mix the current sample with the main sample
-        mixed = add(mixed, main);
-    }
+static bool meters_on = false; // toggled by `m` over the USB serial port
 
-    // TODO: hasn't been verified yet
-    if (looper.active_size == looper.loop_length) {
-        looper.buffer[LOOP_BUFFER][index][ACTIVE_SAMPLE] = add(active, current);
+/**
+ * Stream the level meters, one line per published window (about ten a second):
+ *
+ *   M <window> in <peak> <rms> <clips> out ... 0main ... 0active ... 0mix ... 1main ...
+ *
+ * with peak and RMS in dBFS. A line goes out in whatever pieces fit in the CDC buffer, so the main
+ * loop never waits on USB; windows that are published while one is still going out are skipped
+ * (the window numbers show the gap).
+*/
+void poll_meters() {
+    static char line[32 + NUM_METERS * 32];
+    static int length = 0;
+    static int sent = 0;
+    static uint32_t last_window = 0;
+
+    if (sent < length) {
+        uint32_t available = tud_cdc_write_available();
+        uint32_t size = length - sent;
+        sent += tud_cdc_write(line + sent, size < available ? size : available);
+        tud_cdc_write_flush();
+        return;
     }
 
-    if (in_old_active_region) {
-        // we need to write the old active region
-        looper.buffer[LOOP_BUFFER][index][MAIN_SAMPLE] = add(active, main);
+    meter_window_t window;
+    if (!meters_on || !looper_ctx->level_meters.read(&window, last_window)) return;
+    last_window = window.window;
+
+    const char* layers[] = {"main", "active", "mix"};
+    length = snprintf(line, sizeof(line), "M %u", (unsigned) window.window);
+    for (uint m = 0; m < NUM_METERS; m++) {
+        char name[16];
+        if (m == METER_INPUT) strcpy(name, "in");
+        else if (m == METER_OUTPUT) strcpy(name, "out");
+        else snprintf(name, sizeof(name), "%d%s", (m - 2) / 3, layers[(m - 2) % 3]);
+
+        const meter_t& meter = window.meters[m];
+        length += snprintf(line + length, sizeof(line) - length, " %s %.1f %.1f %u", name, meter_peak_db(meter),
+                           meter_rms_db(meter, window.samples), (unsigned) meter.clips);
     }
+    length += snprintf(line + length, sizeof(line) - length, "\n");
+    sent = 0;
+}
 
-    if (state == RECORD) {
-        looper.buffer[LOOP_BUFFER][index][ACTIVE_SAMPLE] = current;
-    } else if (state == FIRST_RECORD) {
-        looper.buffer[LOOP_BUFFER][index][MAIN_SAMPLE] = current;
+// true while a USB host has the device configured, or could still be getting round to it: from
+// boot or VBUS coming up (where the board senses it) until SYS_CLOCK_USB_WAIT_US after the last
+// time the device was configured. A supply on the USB port never configures it, so that times out
+static bool usb_host_possible() {
+    static uint64_t host_at = 0;
+    static bool vbus_was = false;
+#ifdef PICO_VBUS_PIN
+    bool vbus = gpio_get(PICO_VBUS_PIN);
+#else
+    bool vbus = true; // no way to tell, so only the timeout says there's no host
+#endif
+    if (!vbus) {
+        vbus_was = false;
+        return false;
     }
+    if (!vbus_was || tud_mounted()) host_at = time_us_64();
+    vbus_was = true;
+    return time_us_64() - host_at < SYS_CLOCK_USB_WAIT_US;
+}
 
-    if (state == TEMP_RECORD || state == FIRST_TMP_RECORD) {
-        looper.scratch_buffer[looper.scratch_buffer_size] = current;
-        looper.scratch_buffer_size++;
+// true when nothing needs PSRAM (or much CPU) until the next footswitch press. While a USB host
+// is, or may be, there the clock stays up: USB hasn't been checked at the idle clock
+static bool looper_idle() {
+    for (track_t& t : looper_ctx->tracks) {
+        if (is_streaming(t) || t.button_pressed || t.loading) return false;
     }
+    return !flash_store.busy() && !wav_transfer.busy() && !usb_host_possible();
+}
 
-    // now increment time and length
-    looper.loop_time++;
-    if (state == FIRST_RECORD) looper.loop_length++;
-
-    if (state == RECORD) {
-        if (looper.active_size < looper.loop_length) looper.active_size++;
+// drop to the idle clock once the looper has been idle for a while, and go back up for background jobs
+void poll_sys_clock() {
+    static uint64_t busy_at = 0;
+    if (!looper_idle()) {
+        sys_clock_full();
+        busy_at = time_us_64();
+        return;
     }
+    if (time_us_64() - busy_at < SYS_CLOCK_IDLE_DELAY_US) return;
 
-    if (looper.buffer_offset[LOOP_BUFFER] >= BUFFER_SIZE) {
-        // we're out of bounds, so we need to swap buffers
-        looper.which = !looper.which; // swap buffers. The other buffer must contain the next audio to be played
-
-        // special hack for first reads
-        if (state == FIRST_RECORD) {
-            looper.buffer_start[LOOP_BUFFER] = looper.buffer_start[PSRAM_ACCESS_BUFFER] + BUFFER_SIZE;
-            read_location = 0; // always read from 0 for first_record
-        } else {
-            read_location = (looper.buffer_start[LOOP_BUFFER] + BUFFER_SIZE) % looper.loop_length;
-        }
+    uint32_t saved = save_and_disable_interrupts();
+    if (looper_idle()) sys_clock_idle(); // check again: a footswitch press may have come in since
+    restore_interrupts(saved);
+}
 
-        // see if signal_write is true here, and signal an error if it is.
-        if (signal_write) {
-            printf("Error: previous write not complete\n");
+// single character commands over the USB serial port. A digit selects the track for the next command
+void poll_console() {
+    static uint console_track = 0;
+    int c = getchar_timeout_us(0);
+    if (c == PICO_ERROR_TIMEOUT) return;
+
+    if (c >= '0' && c < '0' + NUM_TRACKS) {
+        console_track = c - '0';
+    } else if (c == 's') {
+        save_loop(looper_ctx->tracks[console_track]);
+    } else if (c == 'l') {
+        load_loop(looper_ctx->tracks[console_track]);
+    } else if (c == 'e') {
+        begin_wav_export(looper_ctx->tracks[console_track]);
+    } else if (c == 'i') {
+        begin_wav_import(looper_ctx->tracks[console_track]);
+    } else if (c == 'j') {
+        print_jitter();
+    } else if (c == 'p') {
+        print_psram_stats();
+    } else if (c == '-' || c == '+' || c == '[' || c == ']') {
+        // main layer (the whole track) down/up, active layer down/up, in eighths
+        track_t& t = looper_ctx->tracks[console_track];
+        uint layer = c == '-' || c == '+' ? MAIN_SAMPLE : ACTIVE_SAMPLE;
+        int32_t step = c == '+' || c == ']' ? GAIN_UNITY / 8 : -GAIN_UNITY / 8;
+        set_layer_gain(t, layer, t.gain[layer].target + step);
+        printf("Track %d %s gain: %d/8\n", t.id, layer == MAIN_SAMPLE ? "main" : "active", t.gain[layer].target * 8 / GAIN_UNITY);
+    } else if (c == '<' || c == '>' || c == 'r' || c == 'x') {
+        // playback rate of every track: slower/faster in eighths of 1x, turn around, back to 1x forward
+        int rate = MASTER_TRACK.looper.prefetch.rate;
+        int direction = rate < 0 ? -1 : 1;
+        int magnitude = abs(rate);
+        if (c == '<') magnitude -= PLAYBACK_RATE_UNITY / 8;
+        if (c == '>') magnitude += PLAYBACK_RATE_UNITY / 8;
+        if (c == 'r') direction = -direction;
+        if (c == 'x') {
+            magnitude = PLAYBACK_RATE_UNITY;
+            direction = 1;
         }
-        signal_write = true;
-    }
-
-    if (looper.loop_time >= looper.loop_length) {
-        looper.loop_time = 0;
+        set_playback_rate(direction * magnitude);
+        printf("Playback rate: %d/8\n", MASTER_TRACK.looper.prefetch.rate * 8 / PLAYBACK_RATE_UNITY);
+    } else if (c == 'c') {
+        printf("System clock: %d Hz\n", sys_clock_hz());
+    } else if (c == 'm') {
+        meters_on = !meters_on;
     }
-
-    return mixed;
 }
 
 int main()
@@ -423,18 +492,41 @@ int main()
     my_config.sck_enable = true;
 
     i2s_program_start_synched(pio0, &my_config, dma_i2s_in_handler, &i2s);
-    
+    irq_set_priority(DMA_IRQ_0, AUDIO_IRQ_PRIORITY);
+    sys_clock_init(&i2s, &my_config);
+#ifdef PICO_VBUS_PIN
+    gpio_init(PICO_VBUS_PIN); // senses whether anything is on the USB port (see usb_host_possible)
+#endif
+
     // Initialize the PSRAM
     ice_sram_init(); // TODO: NOTE: you MUST modify ice_spi.c to stop it from setting i2s pins to SIO.
     // comment out lines 120-122 inclusive in ice_spi.c
 
-    // initialize the footswitch button
-    button_t* footswitch = create_button(FOOTSWITCH_PIN, footswitch_onchange);
+    // give each track its own PSRAM partition and footswitch
+    const uint footswitch_pins[NUM_TRACKS] = FOOTSWITCH_PINS;
+    for (uint i = 0; i < NUM_TRACKS; i++) {
+        looper_ctx->tracks[i].id = i;
+        looper_ctx->tracks[i].psram_base = psram_partition(i);
+        create_button(footswitch_pins[i], footswitch_onchange);
+    }
+
+    flash_store_init();
+    restore_on_boot();
 
     while (1) {
         tud_task(); // tinyusb device task
-        if (signal_write) {
-            write_routine();
+        if (looper_ctx->signal_write) {
+            service_tracks();
+        }
+        if (flash_store.busy()) {
+            poll_flash_store();
+        }
+        if (wav_transfer.busy()) {
+            poll_wav_transfer();
+        } else {
+            poll_console();
+            poll_meters();
         }
+        poll_sys_clock();
     }
 }
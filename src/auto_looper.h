@@ -1,14 +1,65 @@
 #define BUFFER_SIZE 256 // Size in 2 SAMPLES (one active, one main). Max of 200k samples (now 100k because we use 2 buffers)
 #define SCRATCH_BUFFER_SIZE (125*256) // Should be a 2/3 second long
+#define LOOP_HEAD_BLOCKS 4 // blocks at the start of the loop that are also kept in SRAM
+#define LOOP_HEAD_SIZE (LOOP_HEAD_BLOCKS * BUFFER_SIZE)
+
+// refill overruns (a block is needed before PSRAM has delivered it)
+#define OVERRUN_REPEAT true  // play the last good block again while a refill is late. false plays silence
+#define OVERRUN_FADE 32      // samples to fade over when the fallback starts or ends
+#define OVERLOAD_BLOCKS 16   // background PSRAM work is held off for this many blocks after an overrun
+
+#define NUM_TRACKS 2 // each track has its own footswitch, state machine and scratch buffer (~66KB of SRAM)
+
+#ifndef PSRAM_SIZE_BYTES
+#define PSRAM_SIZE_BYTES (4 * 1024 * 1024) // 32Mb. Host builds can make it bigger for longer loops
+#endif
+#define PSRAM_TRACK_BYTES (PSRAM_SIZE_BYTES / NUM_TRACKS)
+#define PSRAM_TRACK_SAMPLES (PSRAM_TRACK_BYTES / 4) // longest loop a track can hold
 
 // used for ram_buffer indexing
 #define MAIN_SAMPLE 0
 #define ACTIVE_SAMPLE 1
 
+// level meters (see level_meter.h): the input, the output, and per track its two layers (as they
+// are stored, before the gains) and its mix. `what` is MAIN_SAMPLE, ACTIVE_SAMPLE or METER_MIX
+#define METER_INPUT 0
+#define METER_OUTPUT 1
+#define METER_MIX 2
+#define METER_TRACK(track, what) (2 + (track) * 3 + (what))
+#define NUM_METERS (2 + NUM_TRACKS * 3)
+
 #include <vector>
 
+#include "layer_gain.h"
+#include "level_meter.h"
+#include "prefetch.h"
+#include "silence_map.h"
+
 using std::vector;
 
+/**
+ * Which blocks of the loop an old active region has been committed in. A block counts as committed
+ * once every sample of the region in it is in the main layer, so a block that is skipped (a refill
+ * overrun) is committed on a later pass, and one that is done is never committed again. Blocks the
+ * region doesn't touch start out committed.
+*/
+struct region_blocks_t {
+    uint32_t done[(SILENCE_MAP_BLOCKS + 31) / 32];
+    uint left; // blocks still to commit
+
+    inline bool is_done(uint block) const {
+        return done[block / 32] & (1u << (block % 32));
+    }
+
+    // returns true if the block wasn't done yet
+    inline bool mark_done(uint block) {
+        if (is_done(block)) return false;
+        done[block / 32] |= 1u << (block % 32);
+        left--;
+        return true;
+    }
+};
+
 struct looper_t {
     int16_t scratch_buffer[SCRATCH_BUFFER_SIZE];
     uint scratch_buffer_start;
@@ -22,15 +73,38 @@ struct looper_t {
     uint loop_length; // loop length in samples (2ish seconds maybe)
     uint loop_time; // current time in samples
     bool which = false; // which buffer is active
+    bool dirty[2];      // the buffer holds samples that aren't in PSRAM yet, so it has to be written back
 
     uint active_start;
     uint active_size;
     bool undo_mode; // when true, the active region is not played back
 
+    prefetch_t prefetch; // playback direction/rate and which block to read next
+
+    silence_map_t silence; // which PSRAM blocks don't need transferring
+
+    // refill overruns, see missed_block in looper.cpp
+    bool fallback;          // the block in LOOP_BUFFER is being repeated because the next one was late
+    uint fallback_position; // loop position the block that is being replaced would have come from
+    uint overload;          // blocks left before background PSRAM work is allowed again
+    bool merge_deferred;    // the last refill left the scratch merge out
+    int16_t last_out;       // the track's last output, to fade from after a jump
+    int16_t fade_from;
+    uint fade_left;
+
+    // copy of the start of the loop in PSRAM. Every PSRAM write goes through to it, and reads of the
+    // loop head come from it, so wrapping around to the start never waits for PSRAM
+    int16_t head[LOOP_HEAD_SIZE][2];
+
+    uint record_until; // when nonzero, the first recording keeps going until the loop is this long
+
     // TODO: must use a vector of old active regions if using a completely linear buffer system :(
     vector<uint> old_active_start;
     vector<uint> old_active_size;
-    vector<uint> old_active_left;
+    vector<region_blocks_t> old_active_blocks;
+    vector<int32_t> old_active_gain; // active layer gain the region was recorded over at. It plays and is committed at it
+    bool commit_block;   // old active regions are committed in the block that is playing (decided at its start)
+    uint commit_regions; // old active regions there were at the start of that block: it's marked done in them at its end
 
     bool in_region(uint start, uint size, uint timestamp) {
         // must consider that the region can wrap past the loop end
@@ -45,32 +119,67 @@ struct looper_t {
         return in_region(active_start, active_size, loop_time);
     }
 
-    bool in_old_active_region(uint timestamp) {
-        bool ret = false;
-        for (int i = 0; i < old_active_start.size(); i++) {
-            if (in_region(old_active_start[i], old_active_size[i], timestamp)) {
-                ret = true;
-                old_active_left[i]--;
-                if (old_active_left[i] == 0) {
-                    printf("Erased old active region with start %d and size %d\n", old_active_start[i], old_active_size[i]);
-                    old_active_start.erase(old_active_start.begin() + i);
-                    old_active_size.erase(old_active_size.begin() + i);
-                    old_active_left.erase(old_active_left.begin() + i);
-                    i--;
-                }
+    // true when `timestamp` is in an old active region that isn't committed there yet. `gain` (if given) gets its active gain
+    bool in_old_active_region(uint timestamp, int32_t* gain = nullptr) {
+        uint block = timestamp / BUFFER_SIZE;
+        for (uint i = 0; i < old_active_start.size(); i++) {
+            if (!old_active_blocks[i].is_done(block) && in_region(old_active_start[i], old_active_size[i], timestamp)) {
+                if (gain) *gain = old_active_gain[i];
+                return true;
             }
         }
-        return ret;
+        return false;
+    }
+
+    bool in_old_active_region(int32_t* gain = nullptr) {
+        return in_old_active_region(loop_time, gain);
+    }
+
+    // true when some old active region still has to be committed in `block`
+    bool old_block_pending(uint block) {
+        for (uint i = 0; i < old_active_blocks.size(); i++) {
+            if (!old_active_blocks[i].is_done(block)) return true;
+        }
+        return false;
+    }
+
+    // the first `count` old active regions have been committed all through `block`
+    void old_block_committed(uint block, uint count) {
+        for (uint i = 0; i < count && i < old_active_blocks.size(); i++) {
+            old_active_blocks[i].mark_done(block);
+        }
     }
 
-    bool in_old_active_region() {
-        return in_old_active_region(loop_time);
+    // forget the old active regions that are committed everywhere
+    void erase_committed_old_regions() {
+        for (uint i = 0; i < old_active_start.size(); i++) {
+            if (old_active_blocks[i].left > 0) continue;
+            printf("Erased old active region with start %d and size %d\n", old_active_start[i], old_active_size[i]);
+            old_active_start.erase(old_active_start.begin() + i);
+            old_active_size.erase(old_active_size.begin() + i);
+            old_active_blocks.erase(old_active_blocks.begin() + i);
+            old_active_gain.erase(old_active_gain.begin() + i);
+            i--;
+        }
     }
 
-    void add_old_active_region(uint start, uint size) {
+    void add_old_active_region(uint start, uint size, int32_t gain) {
+        region_blocks_t blocks;
+        memset(blocks.done, 0xff, sizeof(blocks.done));
+        uint loop_blocks = (loop_length + BUFFER_SIZE - 1) / BUFFER_SIZE;
+        uint first = start / BUFFER_SIZE;
+        uint count = (start % BUFFER_SIZE + size + BUFFER_SIZE - 1) / BUFFER_SIZE;
+        if (count > loop_blocks) count = loop_blocks;
+        for (uint i = 0; i < count; i++) {
+            uint block = (first + i) % loop_blocks;
+            blocks.done[block / 32] &= ~(1u << (block % 32));
+        }
+        blocks.left = count;
+
         old_active_start.push_back(start);
         old_active_size.push_back(size);
-        old_active_left.push_back(size);
+        old_active_blocks.push_back(blocks);
+        old_active_gain.push_back(gain);
     }
     
     looper_t() {
@@ -78,17 +187,32 @@ struct looper_t {
         buffer_start[1] = 0;
         buffer_offset[0] = 0;
         buffer_offset[1] = 0;
+        dirty[0] = false;
+        dirty[1] = false;
+        memset(head, 0, sizeof(head)); // matches the silence map: nothing recorded yet
+        fallback = false;
+        fallback_position = 0;
+        overload = 0;
+        merge_deferred = false;
+        last_out = 0;
+        fade_from = 0;
+        fade_left = 0;
         loop_length = 0;
         loop_time = 0;
+        record_until = 0;
 
         // TODO: needed?
         scratch_buffer_start = 0;
         scratch_buffer_size = 0;
+        scratch_buffer_ptr = 0;
         active_start = 0;
         active_size = 0;
         old_active_start = vector<uint>();
         old_active_size = vector<uint>();
-        old_active_left = vector<uint>();
+        old_active_blocks = vector<region_blocks_t>();
+        old_active_gain = vector<int32_t>();
+        commit_block = false;
+        commit_regions = 0;
         undo_mode = false;
     }
 
@@ -98,6 +222,14 @@ struct looper_t {
     }
 };
 
+/**
+ * PSRAM allocator: the address space is split into one equal partition per track, and a track's
+ * samples are stored at `psram_partition(track) + sample * 4`.
+*/
+inline constexpr uint32_t psram_partition(uint track) {
+    return track * PSRAM_TRACK_BYTES;
+}
+
 /**
  * Add two signed ints, but if the result overflows or underflows, clip instead
 */
@@ -109,5 +241,113 @@ inline constexpr int16_t add(int16_t a, int16_t b) {
     return result;
 }
 
+// the macros below work on whichever `looper` is in scope (each track has its own)
+#define PSRAM_ACCESS_BUFFER (!looper.which)   // the buffer that is read from and then written to by PSRAM
+#define LOOP_BUFFER (looper.which)            // the buffer that is used for looping by the CPU
+
+enum state_t { 
+    IDLE, 
+    FIRST_RECORD, FIRST_TMP_RECORD, TEMP_RECORD, RECORD, 
+    FIRST_PLAYBACK, PLAY, PLAYBACK1,
+    FIRST_STOP, STOPPED 
+};
+extern const char* state_names[];
+
+struct track_t {
+    looper_t looper;
+    state_t state = IDLE;
+    uint id;
+    uint psram_base; // byte address of this track's PSRAM partition
+
+    // state machine variables
+    bool button_released = true;
+    bool button_pressed = false;
+    uint64_t last_time = 0;
+    bool cued = false; // pressed to start or resume, and waiting to be in phase with the other tracks
+
+    // used to tell the main loop to write to PSRAM and then read from it
+    volatile bool signal_write = false;
+    volatile uint read_location = 0;
+
+    volatile bool loading = false; // a saved loop is being copied into PSRAM, so the track is muted
+    volatile bool saving = false;  // the loop is being copied to flash. Cleared by any write to the loop or a reset, which spoil the copy
+
+    layer_gain_t gain[2]; // playback gain of the main and active layers. A setting, so it survives a reset
+    envelope_t old_region_fade; // edge fades of the old active regions, which keep their own gain
+};
+
+// true when the track needs PSRAM refills, i.e. flash store work has to fit around them
+inline bool is_streaming(track_t& t) {
+    return t.state != IDLE && t.state != STOPPED && t.state != FIRST_STOP;
+}
+
+struct psram_stats_t {
+    uint32_t bytes_read;
+    uint32_t bytes_written;
+    uint32_t writebacks;         // staging blocks written back to PSRAM at a buffer swap
+    uint32_t writebacks_skipped; // clean staging blocks that didn't need it
+    uint32_t silent_skipped;     // block transfers left out because the block is silent
+    uint32_t head_hits;          // reads served from the loop head in SRAM
+    uint32_t overruns;           // block swaps that found the refill still not done
+    uint32_t fallback_blocks;    // blocks played from the fallback instead of PSRAM
+};
+
+#ifndef LOOPER_CONTEXT_LOCAL
+#define LOOPER_CONTEXT_LOCAL // the host build makes it thread_local, so each thread can run its own context
+#endif
+
+/**
+ * Everything the engine keeps between samples, apart from PSRAM: the tracks and what they share.
+ * The firmware only ever has the one, but the engine works on whichever `looper_ctx` points at, so
+ * host tools can run any number of them (one at a time on each thread).
+*/
+struct looper_context_t {
+    track_t tracks[NUM_TRACKS];
+
+    // position inside the current block, shared by all tracks. Tracks only start or resume playing in
+    // phase with it, so that every track swaps buffers on the same sample and all the PSRAM refills
+    // can be done in one burst.
+    uint block_clock = 0;
+
+    // the master's loop position at the start of the current sample, or -1 while it isn't playing
+    // through its loop at 1x. The other tracks start and resume in step with it (see in_phase)
+    int master_time = -1;
+
+    // set by the audio ISR when any track needs its PSRAM access buffer serviced
+    volatile bool signal_write = false;
+
+    bool psram_window = false; // set after a refill burst, when the PSRAM bus is free for one background chunk
+
+    psram_stats_t psram_stats = {};
+
+    level_meters_t level_meters;
+};
+
+extern LOOPER_CONTEXT_LOCAL looper_context_t* looper_ctx;
+#define MASTER_TRACK (looper_ctx->tracks[0])
+
 // run the main state machine and get the next sample
-int16_t get_next_sample(int16_t current);
\ No newline at end of file
+int16_t get_next_sample(int16_t current);
+
+// called with the new (debounced) footswitch state, which is low while pressed
+void footswitch_changed(track_t& t, bool state);
+
+// service every track that asked for a PSRAM refill. Called from the main loop when signal_write is set
+void service_tracks();
+
+// transfer samples between a track's PSRAM partition and a staging block, wrapping at the loop end
+void psram_transfer(track_t& t, uint start, int16_t (*data)[2], uint size, bool write);
+
+// true when the PSRAM bus is free for one chunk of background work (flash store, USB transfers)
+bool take_psram_window();
+
+// a new loop is in the track's PSRAM: prime the staging buffers and leave the track stopped
+void start_stopped(track_t& t);
+
+// set the playback rate (Q8, see prefetch.h). Negative rates play the loop in reverse.
+// Takes effect at the next block boundary while playing back.
+void set_playback_rate(int rate);
+
+// set the playback gain (Q15, up to GAIN_UNITY) of a track's MAIN_SAMPLE or ACTIVE_SAMPLE layer.
+// It ramps there over a few blocks
+void set_layer_gain(track_t& t, uint layer, int32_t gain);
\ No newline at end of file
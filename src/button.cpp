@@ -11,50 +11,106 @@
 
 #include <stdio.h>
 #include <stdint.h>
-#include <stdlib.h>
 #include "pico/stdlib.h"
+#include "hardware/irq.h"
+#include "hardware/timer.h"
 
 #include "button.h"
 
-closure_t handlers[28] = {NULL};
-alarm_id_t alarm_ids[28];
+/*
+ * All buttons are debounced together: every BUTTON_SAMPLE_US a hardware alarm reads every GPIO at
+ * once and runs a 2 bit vertical counter per pin. A pin's debounced state only flips after it has
+ * read differently for DEBOUNCE_SAMPLES samples in a row. Bouncing contacts don't cause any extra
+ * interrupts, and nothing is allocated.
+ */
+
+static button_t buttons[MAX_BUTTONS];
+static uint num_buttons = 0;
+
+static uint32_t pin_mask = 0;  // pins that belong to a button
+static uint32_t debounced = 0; // debounced state of every pin
+static uint32_t count0 = ~0u;  // vertical counter, low bit (all ones is the idle state)
+static uint32_t count1 = ~0u;  // vertical counter, high bit
+static uint32_t last_raw = 0;
 
-long long int handle_button_alarm(long int a, void *p) {
-  button_t *b = (button_t *)(p);
-  bool state = gpio_get(b->pin);
-  if (state != b->state) {
-    b->state = state;
-    b->onchange(b);
+static int alarm_num = -1;
+static volatile button_stats_t stats;
+
+// the sampling IRQ has the lowest priority, so it can be held up past its next target. The alarm
+// isn't armed then (set_target returns true), and sampling would stop for good: aim again from now
+static void schedule_sample(void) {
+  while (hardware_alarm_set_target(alarm_num, make_timeout_time_us(BUTTON_SAMPLE_US))) {
   }
-  return 0;
 }
 
-void handle_button_interrupt(void *p) {
-  button_t *b = (button_t *)(p);
-  if (alarm_ids[b->pin]) cancel_alarm(alarm_ids[b->pin]);
-  alarm_ids[b->pin] = add_alarm_in_us(DEBOUNCE_US, handle_button_alarm, b, true);
-}
+static void sample_buttons(uint alarm) {
+  uint32_t start = time_us_32();
+  uint32_t raw = gpio_get_all() & pin_mask;
+
+  // count up (mod 4) for pins that differ from their debounced state, and reset the rest
+  uint32_t differs = raw ^ debounced;
+  count0 = ~(count0 & differs);
+  count1 = count0 ^ (count1 & differs);
+  uint32_t toggled = differs & count0 & count1;
+  debounced ^= toggled;
+
+  stats.edges += __builtin_popcount(raw ^ last_raw);
+  last_raw = raw;
+
+  for (uint i = 0; toggled && i < num_buttons; i++) {
+    button_t *b = &buttons[i];
+    if (toggled & (1u << b->pin)) {
+      b->state = (debounced >> b->pin) & 1;
+      b->onchange(b);
+    }
+  }
 
-void handle_interrupt(uint gpio, uint32_t events) {
-  closure_t handler = handlers[gpio];
-  handler.fn(handler.argument);
+  schedule_sample();
+
+  uint32_t elapsed = time_us_32() - start;
+  stats.samples++;
+  if (elapsed > stats.max_sample_us) stats.max_sample_us = elapsed;
 }
 
-void listen(uint pin, int condition, handler fn, void *arg) {
-  gpio_set_irq_enabled_with_callback(pin, condition, true, handle_interrupt);
-  closure_t *handler = (closure_t*) malloc(sizeof(closure_t));
-  handler->argument = arg;
-  handler->fn = fn;
-  handlers[pin] = *handler;
+static void start_sampling(void) {
+  alarm_num = hardware_alarm_claim_unused(true);
+  hardware_alarm_set_callback(alarm_num, sample_buttons);
+  irq_set_priority(TIMER_IRQ_0 + alarm_num, BUTTON_IRQ_PRIORITY);
+  schedule_sample();
 }
 
 button_t * create_button(int pin, void (*onchange)(button_t *)) {
+  if (num_buttons >= MAX_BUTTONS) {
+    panic("Too many buttons");
+  }
   gpio_init(pin);
   gpio_pull_up(pin);
-  button_t *b = (button_t *)(malloc(sizeof(button_t)));
-  listen(pin, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, handle_button_interrupt, b);
+
+  button_t *b = &buttons[num_buttons];
   b->pin = pin;
   b->onchange = onchange;
   b->state = gpio_get(pin);
+
+  // start out debounced at the current level, so there is no change event at startup
+  uint32_t saved = save_and_disable_interrupts();
+  debounced = (debounced & ~(1u << pin)) | ((uint32_t)b->state << pin);
+  last_raw = debounced;
+  pin_mask |= 1u << pin;
+  num_buttons++;
+  restore_interrupts(saved);
+
+  if (alarm_num < 0) {
+    start_sampling();
+  }
   return b;
 }
+
+button_stats_t button_take_stats(void) {
+  uint32_t saved = save_and_disable_interrupts();
+  button_stats_t copy = {stats.samples, stats.max_sample_us, stats.edges};
+  stats.samples = 0;
+  stats.max_sample_us = 0;
+  stats.edges = 0;
+  restore_interrupts(saved);
+  return copy;
+}
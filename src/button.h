@@ -13,12 +13,20 @@
 #define PICO_BUTTON_H
 
 #include "pico/stdlib.h"
+#include "hardware/irq.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define DEBOUNCE_US 2000
+#define DEBOUNCE_SAMPLES 4 // a pin has to read the same for this many samples in a row
+#define BUTTON_SAMPLE_US (DEBOUNCE_US / DEBOUNCE_SAMPLES)
+
+#define MAX_BUTTONS 8
+
+// Buttons are sampled from a timer IRQ, which must never hold off the audio DMA IRQ
+#define BUTTON_IRQ_PRIORITY PICO_LOWEST_IRQ_PRIORITY
 
 typedef struct button_t {
   uint8_t pin;
@@ -26,25 +34,19 @@ typedef struct button_t {
   void (*onchange)(struct button_t *button);
 } button_t;
 
-typedef void (*handler)(void *argument);
-
-typedef struct {
-  void * argument;
-  handler fn;
-} closure_t;
-
-long long int handle_button_alarm(long int a, void *p);
-
-void handle_button_interrupt(void *p);
-
-void handle_interrupt(uint gpio, uint32_t events);
-
-void listen(uint pin, int condition, handler fn, void *arg);
+typedef struct button_stats_t {
+  uint32_t samples;
+  uint32_t max_sample_us; // longest time spent in one sample, including onchange callbacks
+  uint32_t edges;         // raw edges seen, i.e. how much bouncing was filtered out
+} button_stats_t;
 
 button_t * create_button(int pin, void (*onchange)(button_t *));
 
+// read and reset the sampling statistics
+button_stats_t button_take_stats(void);
+
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,48 @@
+#include "hardware/flash.h"
+#include "pico/multicore.h"
+#include "pico/stdlib.h"
+
+#include "flash_store.h"
+
+/*
+ * The flash worker runs on core1 and does nothing but erase and program sectors. The firmware is
+ * built with the copy_to_ram binary type, so neither core (nor any ISR) executes from flash while
+ * XIP is switched off for an erase; the audio ISR and the PSRAM refills on core0 keep running.
+ */
+
+static_assert(FLASH_STORE_SECTOR_SIZE == FLASH_SECTOR_SIZE, "flash store sectors must match the flash");
+static_assert(FLASH_STORE_PAGE_SIZE == FLASH_PAGE_SIZE, "flash store pages must match the flash");
+
+static volatile bool worker_busy = false;
+
+static void flash_worker() {
+    while (1) {
+        flash_sector_t* sector = (flash_sector_t*) multicore_fifo_pop_blocking();
+        uint32_t offset = FLASH_STORE_OFFSET + sector->index * FLASH_SECTOR_SIZE;
+        uint32_t size = (sector->fill + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+        flash_range_erase(offset, FLASH_SECTOR_SIZE);
+        flash_range_program(offset, sector->data, size);
+        multicore_fifo_push_blocking((uint32_t) sector);
+    }
+}
+
+void flash_store_init() {
+    multicore_launch_core1(flash_worker);
+}
+
+bool flash_store_submit(flash_sector_t* sector) {
+    if (worker_busy || !multicore_fifo_wready()) return false;
+    worker_busy = true;
+    multicore_fifo_push_blocking((uint32_t) sector);
+    return true;
+}
+
+flash_sector_t* flash_store_poll() {
+    if (!multicore_fifo_rvalid()) return nullptr;
+    worker_busy = false;
+    return (flash_sector_t*) multicore_fifo_pop_blocking();
+}
+
+const uint8_t* flash_store_data() {
+    return (const uint8_t*) (XIP_BASE + FLASH_STORE_OFFSET);
+}
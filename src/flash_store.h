@@ -0,0 +1,261 @@
+#ifndef FLASH_STORE_H
+#define FLASH_STORE_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Saving and loading loops to/from on-board flash without stopping the audio.
+ *
+ * The store region starts with a header sector, followed by the loop samples in the same
+ * layout PSRAM uses (main/active interleaved, 4 bytes per sample). The header is invalidated
+ * before a save and only written once every data sector is in flash, so a save that is
+ * interrupted by a power cut leaves no loop behind instead of a corrupt one.
+ *
+ * This struct only does the bookkeeping, so it can be run on the host (see host/flash_sim.cpp).
+ * The main loop moves one chunk at a time between PSRAM and the sector buffers, right after it
+ * has serviced the PSRAM refills, and hands full sectors to the flash worker on core1.
+ */
+
+#define FLASH_STORE_SECTOR_SIZE 4096
+#define FLASH_STORE_PAGE_SIZE 256
+#define FLASH_STORE_MAGIC 0x504f4f4c          // "LOOP"
+#define FLASH_STORE_CHUNK_SAMPLES 256         // samples moved per main loop window (one PSRAM block)
+
+#ifdef PICO_FLASH_SIZE_BYTES
+#define FLASH_STORE_OFFSET (PICO_FLASH_SIZE_BYTES / 2) // the second half of flash is kept for the loop
+#define FLASH_STORE_REGION_SIZE (PICO_FLASH_SIZE_BYTES - FLASH_STORE_OFFSET)
+#endif
+
+struct flash_store_header_t {
+    uint32_t magic;
+    uint32_t loop_length;  // in samples
+    uint32_t active_start;
+    uint32_t active_size;
+    uint32_t undo_mode;
+    uint32_t checksum;     // of the sample data
+};
+
+// FNV-1a, so the checksum can be built up one chunk at a time
+inline uint32_t flash_store_checksum(uint32_t hash, const uint8_t* data, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+#define FLASH_STORE_CHECKSUM_INIT 2166136261u
+
+enum flash_job_t { FLASH_JOB_NONE, FLASH_JOB_SAVE, FLASH_JOB_LOAD };
+
+enum flash_sector_state_t {
+    SECTOR_FREE,    // can be filled
+    SECTOR_READY,   // full, waiting to be handed to the flash worker
+    SECTOR_BUSY     // being erased and programmed by the flash worker
+};
+
+struct flash_sector_t {
+    flash_sector_state_t state;
+    uint32_t index; // sector inside the store region. 0 is the header
+    uint32_t fill;  // bytes used
+    uint8_t data[FLASH_STORE_SECTOR_SIZE];
+};
+
+struct flash_store_t {
+    flash_job_t job = FLASH_JOB_NONE;
+    uint32_t track = 0;
+    flash_store_header_t header;
+    uint32_t region_size = 0; // bytes available for the store, including the header sector
+
+    uint32_t progress = 0;     // samples moved so far
+    uint32_t next_index = 1;   // next data sector to program
+    uint32_t checksum = FLASH_STORE_CHECKSUM_INIT;
+    bool header_written = false;
+
+    // double buffered, so one sector can be filled while the other is being programmed
+    flash_sector_t sectors[2];
+    uint32_t filling = 0;
+
+    flash_store_t(uint32_t region_size = 0) : region_size(region_size) {
+        for (flash_sector_t& sector : sectors) sector.state = SECTOR_FREE;
+    }
+
+    inline uint32_t max_samples() const {
+        return (region_size - FLASH_STORE_SECTOR_SIZE) / 4;
+    }
+
+    // also true while the flash worker still has a sector of an aborted save: the flash isn't
+    // readable and the sector buffers can't be reused until it's done
+    inline bool busy() const {
+        return job != FLASH_JOB_NONE || sectors[0].state == SECTOR_BUSY || sectors[1].state == SECTOR_BUSY;
+    }
+
+    /**
+     * Start saving a loop. `loop` holds everything but the checksum. The first sector handed to
+     * the flash worker invalidates the old header.
+    */
+    bool begin_save(uint32_t track_id, const flash_store_header_t& loop) {
+        if (busy() || loop.loop_length == 0 || loop.loop_length > max_samples()) return false;
+        job = FLASH_JOB_SAVE;
+        track = track_id;
+        header = loop;
+        progress = 0;
+        next_index = 1;
+        checksum = FLASH_STORE_CHECKSUM_INIT;
+        header_written = false;
+
+        flash_sector_t& invalid = sectors[1];
+        memset(invalid.data, 0xff, FLASH_STORE_PAGE_SIZE);
+        invalid.index = 0;
+        invalid.fill = FLASH_STORE_PAGE_SIZE;
+        invalid.state = SECTOR_READY;
+
+        sectors[0].fill = 0;
+        sectors[0].state = SECTOR_FREE;
+        filling = 0;
+        return true;
+    }
+
+    /**
+     * The next range of samples to read from PSRAM, and where to read it to.
+     * Returns the number of samples, or 0 if there is nothing to do right now.
+    */
+    uint32_t next_save_chunk(uint32_t* start, uint8_t** dest) {
+        flash_sector_t& sector = sectors[filling];
+        if (job != FLASH_JOB_SAVE || progress >= header.loop_length || sector.state != SECTOR_FREE) return 0;
+
+        uint32_t count = header.loop_length - progress;
+        if (count > FLASH_STORE_CHUNK_SAMPLES) count = FLASH_STORE_CHUNK_SAMPLES;
+        uint32_t room = (FLASH_STORE_SECTOR_SIZE - sector.fill) / 4;
+        if (count > room) count = room;
+
+        *start = progress;
+        *dest = sector.data + sector.fill;
+        return count;
+    }
+
+    // called once a chunk from next_save_chunk has been read in
+    void save_chunk_done(uint32_t count) {
+        flash_sector_t& sector = sectors[filling];
+        checksum = flash_store_checksum(checksum, sector.data + sector.fill, count * 4);
+        sector.fill += count * 4;
+        progress += count;
+
+        if (sector.fill == FLASH_STORE_SECTOR_SIZE || progress == header.loop_length) {
+            sector.index = next_index++;
+            sector.state = SECTOR_READY;
+            filling = !filling;
+        }
+    }
+
+    // a sector that should be handed to the flash worker, if there is one
+    flash_sector_t* ready_sector() {
+        for (flash_sector_t& sector : sectors) {
+            if (sector.state == SECTOR_READY) return &sector;
+        }
+        return nullptr;
+    }
+
+    void sector_submitted(flash_sector_t* sector) {
+        sector->state = SECTOR_BUSY;
+    }
+
+    /**
+     * Called when the flash worker has finished with a sector. Once the last data sector is in
+     * flash, the real header goes out. Returns true when the save is complete.
+    */
+    bool sector_written(flash_sector_t* sector) {
+        bool was_header = sector->index == 0 && progress == header.loop_length;
+        sector->state = SECTOR_FREE;
+        sector->fill = 0;
+
+        if (was_header && header_written) {
+            job = FLASH_JOB_NONE;
+            return true;
+        }
+
+        bool data_done = progress == header.loop_length
+            && sectors[0].state == SECTOR_FREE && sectors[1].state == SECTOR_FREE;
+        if (job == FLASH_JOB_SAVE && data_done && !header_written) {
+            header.magic = FLASH_STORE_MAGIC;
+            header.checksum = checksum;
+            memset(sector->data, 0xff, FLASH_STORE_PAGE_SIZE);
+            memcpy(sector->data, &header, sizeof(header));
+            sector->index = 0;
+            sector->fill = FLASH_STORE_PAGE_SIZE;
+            sector->state = SECTOR_READY;
+            header_written = true;
+        }
+        return false;
+    }
+
+    /**
+     * Give up on a save whose loop changed before all of it was read, so the copy in flash would be
+     * a mix of before and after. The old header is already invalidated, so no loop is left in flash.
+     * Returns false if there was nothing left to read, in which case the save carries on.
+    */
+    bool abort_save() {
+        if (job != FLASH_JOB_SAVE || progress == header.loop_length) return false;
+        job = FLASH_JOB_NONE;
+        for (flash_sector_t& sector : sectors) {
+            if (sector.state == SECTOR_READY) sector.state = SECTOR_FREE;
+            sector.fill = 0;
+        }
+        return true;
+    }
+
+    /**
+     * Start copying a saved loop from flash back into PSRAM. `saved` is the header as found in
+     * flash; it has to be checked with header_valid first.
+    */
+    bool begin_load(uint32_t track_id, const flash_store_header_t& saved) {
+        if (busy() || !header_valid(saved)) return false;
+        job = FLASH_JOB_LOAD;
+        track = track_id;
+        header = saved;
+        progress = 0;
+        checksum = FLASH_STORE_CHECKSUM_INIT;
+        return true;
+    }
+
+    /**
+     * The next range of samples to copy from flash to PSRAM. `flash_offset` is relative to the
+     * start of the store region. Returns the number of samples, or 0 if there is nothing left.
+    */
+    uint32_t next_load_chunk(uint32_t* start, uint32_t* flash_offset) const {
+        if (job != FLASH_JOB_LOAD || progress >= header.loop_length) return 0;
+        uint32_t count = header.loop_length - progress;
+        if (count > FLASH_STORE_CHUNK_SAMPLES) count = FLASH_STORE_CHUNK_SAMPLES;
+        *start = progress;
+        *flash_offset = FLASH_STORE_SECTOR_SIZE + progress * 4;
+        return count;
+    }
+
+    /**
+     * Called once a chunk from next_load_chunk has been copied. `data` is the chunk as it was in
+     * flash. Returns true when the load is complete; check load_ok() to see if the data was intact.
+    */
+    bool load_chunk_done(const uint8_t* data, uint32_t count) {
+        checksum = flash_store_checksum(checksum, data, count * 4);
+        progress += count;
+        if (progress < header.loop_length) return false;
+        job = FLASH_JOB_NONE;
+        return true;
+    }
+
+    inline bool load_ok() const {
+        return checksum == header.checksum;
+    }
+
+    inline bool header_valid(const flash_store_header_t& saved) const {
+        return saved.magic == FLASH_STORE_MAGIC && saved.loop_length > 0 && saved.loop_length <= max_samples();
+    }
+};
+
+// flash worker running on core1 (flash_store.cpp)
+void flash_store_init();
+bool flash_store_submit(flash_sector_t* sector); // false if the worker is still busy
+flash_sector_t* flash_store_poll();              // a sector the worker has finished with, or nullptr
+const uint8_t* flash_store_data();               // the store region, memory mapped
+
+#endif
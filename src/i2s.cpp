@@ -29,33 +29,11 @@
 
 const i2s_config i2s_config_default = {48000, 256, 32, 10, 6, 7, 8, true};
 
-static float pio_div(float freq, uint16_t* div, uint8_t* frac) {
-    float clk   = (float)clock_get_hz(clk_sys);
-    float ratio = clk / freq;
-    float d;
-    float f = modff(ratio, &d);
-    *div    = (uint16_t)d;
-    *frac   = (uint8_t)(f * 256.0f);
-
-    // Use post-converted values to get actual freq after any rounding
-    float result = clk / ((float)*div + ((float)*frac / 256.0f));
-
-    return result;
-}
+static_assert(i2s_sck_program_pio_mult == I2S_SCK_PIO_MULT, "i2s_clocks.h is out of step with i2s.pio");
+static_assert(i2s_out_master_program_pio_mult == I2S_BCK_PIO_MULT, "i2s_clocks.h is out of step with i2s.pio");
 
 static void calc_clocks(const i2s_config* config, pio_i2s_clocks* clocks) {
-    // Try to get a precise ratio between SCK and BCK regardless of how
-    // perfect the system_clock divides. First, see what sck we can actually get:
-    float sck_desired   = (float)config->fs * (float)config->sck_mult * (float)i2s_sck_program_pio_mult;
-    float sck_attained  = pio_div(sck_desired, &clocks->sck_d, &clocks->sck_f);
-    clocks->fs_attained = sck_attained / (float)config->sck_mult / (float)i2s_sck_program_pio_mult;
-
-    // Now that we have the closest fs our dividers will give us, we can
-    // re-calculate SCK and BCK as correct ratios of this adjusted fs:
-    float sck_hz       = clocks->fs_attained * (float)config->sck_mult;
-    clocks->sck_pio_hz = pio_div(sck_hz * (float)i2s_sck_program_pio_mult, &clocks->sck_d, &clocks->sck_f);
-    float bck_hz       = clocks->fs_attained * (float)config->bit_depth * 2.0f;
-    clocks->bck_pio_hz = pio_div(bck_hz * (float)i2s_out_master_program_pio_mult, &clocks->bck_d, &clocks->bck_f);
+    i2s_calc_clocks(clock_get_hz(clk_sys), config->fs, config->sck_mult, config->bit_depth, clocks);
 }
 
 static bool validate_sck_bck_sync(pio_i2s_clocks* clocks) {
@@ -238,3 +216,14 @@ void i2s_program_start_synched(PIO pio, const i2s_config* config, void (*dma_han
     dma_double_buffer_init(i2s, dma_handler);
     pio_enable_sm_mask_in_sync(i2s->pio, i2s->sm_mask);
 }
+
+void i2s_set_clkdivs(pio_i2s* i2s, const pio_i2s_clocks* clocks) {
+    for (uint sm = 0; sm < 4; sm++) {
+        if (!(i2s->sm_mask & (1u << sm))) continue;
+        if (sm == i2s->sm_dout) {
+            pio_sm_set_clkdiv_int_frac(i2s->pio, sm, clocks->bck_d, clocks->bck_f);
+        } else {
+            pio_sm_set_clkdiv_int_frac(i2s->pio, sm, clocks->sck_d, clocks->sck_f);
+        }
+    }
+}
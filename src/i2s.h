@@ -21,6 +21,7 @@
  */
 #include <stdio.h>
 #include "hardware/pio.h"
+#include "i2s_clocks.h"
 
 #ifndef I2S_TEST_I2S_H
 #define I2S_TEST_I2S_H
@@ -39,19 +40,6 @@ typedef struct i2s_config {
     bool     sck_enable;
 } i2s_config;
 
-typedef struct pio_i2s_clocks {
-    // Clock computation results
-    float fs_attained;
-    float sck_pio_hz;
-    float bck_pio_hz;
-
-    // PIO divider ratios to obtain the computed clocks above
-    uint16_t sck_d;
-    uint8_t  sck_f;
-    uint16_t bck_d;
-    uint8_t  bck_f;
-} pio_i2s_clocks;
-
 // NOTE: Use __attribute__ ((aligned(8))) on this struct or the DMA wrap won't work!
 typedef struct pio_i2s {
     PIO        pio;
@@ -75,4 +63,9 @@ extern const i2s_config i2s_config_default;
 void i2s_program_start_slaved(PIO pio, const i2s_config* config, void (*dma_handler)(void), pio_i2s* i2s);
 void i2s_program_start_synched(PIO pio, const i2s_config* config, void (*dma_handler)(void), pio_i2s* i2s);
 
+/* Loads new dividers into the running state machines: BCK for the out block, SCK for the rest.
+ * This doesn't pause or restart them, see sys_clock.cpp for doing that around a clock change.
+ */
+void i2s_set_clkdivs(pio_i2s* i2s, const pio_i2s_clocks* clocks);
+
 #endif  // I2S_TEST_I2S_H
@@ -0,0 +1,76 @@
+#ifndef I2S_CLOCKS_H
+#define I2S_CLOCKS_H
+
+#include <math.h>
+#include <stdint.h>
+
+/*
+ * The PIO divider math for the I2S state machines. It takes the system clock as an argument
+ * instead of asking the hardware, so it can be worked out for clocks the chip isn't running at:
+ * sys_clock.cpp uses it to pick the idle clock, and host/clock_plan.cpp runs it on the host.
+ */
+
+// I2S clock to PIO clock ratios of the programs in i2s.pio (checked against them in i2s.cpp)
+#define I2S_SCK_PIO_MULT 2
+#define I2S_BCK_PIO_MULT 2
+
+typedef struct pio_i2s_clocks {
+    // Clock computation results
+    float fs_attained;
+    float sck_pio_hz;
+    float bck_pio_hz;
+
+    // PIO divider ratios to obtain the computed clocks above
+    uint16_t sck_d;
+    uint8_t  sck_f;
+    uint16_t bck_d;
+    uint8_t  bck_f;
+} pio_i2s_clocks;
+
+inline float i2s_pio_div(uint32_t clk_hz, float freq, uint16_t* div, uint8_t* frac) {
+    float clk   = (float)clk_hz;
+    float ratio = clk / freq;
+    float d;
+    float f = modff(ratio, &d);
+    *div    = (uint16_t)d;
+    *frac   = (uint8_t)(f * 256.0f);
+
+    // Use post-converted values to get actual freq after any rounding
+    float result = clk / ((float)*div + ((float)*frac / 256.0f));
+
+    return result;
+}
+
+inline void i2s_calc_clocks(uint32_t clk_hz, uint32_t fs, uint32_t sck_mult, uint8_t bit_depth, pio_i2s_clocks* clocks) {
+    // Try to get a precise ratio between SCK and BCK regardless of how
+    // perfect the system_clock divides. First, see what sck we can actually get:
+    float sck_desired   = (float)fs * (float)sck_mult * (float)I2S_SCK_PIO_MULT;
+    float sck_attained  = i2s_pio_div(clk_hz, sck_desired, &clocks->sck_d, &clocks->sck_f);
+    clocks->fs_attained = sck_attained / (float)sck_mult / (float)I2S_SCK_PIO_MULT;
+
+    // Now that we have the closest fs our dividers will give us, we can
+    // re-calculate SCK and BCK as correct ratios of this adjusted fs:
+    float sck_hz       = clocks->fs_attained * (float)sck_mult;
+    clocks->sck_pio_hz = i2s_pio_div(clk_hz, sck_hz * (float)I2S_SCK_PIO_MULT, &clocks->sck_d, &clocks->sck_f);
+    float bck_hz       = clocks->fs_attained * (float)bit_depth * 2.0f;
+    clocks->bck_pio_hz = i2s_pio_div(clk_hz, bck_hz * (float)I2S_BCK_PIO_MULT, &clocks->bck_d, &clocks->bck_f);
+}
+
+// true if a divider of int + frac/256 turns clk_hz into exactly pio_hz
+inline bool i2s_divider_exact(uint32_t clk_hz, uint64_t pio_hz, uint16_t div, uint8_t frac) {
+    return div >= 1 && (uint64_t)clk_hz * 256 == ((uint64_t)div * 256 + frac) * pio_hz;
+}
+
+/**
+ * true if the dividers in `clocks` give exactly `fs`, with SCK and BCK in whole ratio. The float
+ * results in `clocks` can't tell a rounded divider from an exact one, so this is checked in integers.
+*/
+inline bool i2s_clocks_exact(uint32_t clk_hz, uint32_t fs, uint32_t sck_mult, uint8_t bit_depth, const pio_i2s_clocks* clocks) {
+    uint64_t sck_pio_hz = (uint64_t)fs * sck_mult * I2S_SCK_PIO_MULT;
+    uint64_t bck_pio_hz = (uint64_t)fs * bit_depth * 2 * I2S_BCK_PIO_MULT;
+    return sck_pio_hz % bck_pio_hz == 0
+        && i2s_divider_exact(clk_hz, sck_pio_hz, clocks->sck_d, clocks->sck_f)
+        && i2s_divider_exact(clk_hz, bck_pio_hz, clocks->bck_d, clocks->bck_f);
+}
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef LAYER_GAIN_H
+#define LAYER_GAIN_H
+
+#include <stdint.h>
+
+/*
+ * Playback gain of a track's two layers, in Q15 (GAIN_UNITY is 1.0). The active layer's gain is
+ * relative to the main layer, and the main layer's gain applies to the whole track:
+ *
+ *   out = (main + active * active_gain) * main_gain
+ *
+ * An active region that has been recorded over (an old active region) keeps the active gain it had
+ * then, and is committed into the main layer at it (main += active * gain), so committing it
+ * doesn't change what is heard.
+ *
+ * The gains are planned once per block as piecewise-linear envelopes: a change to a gain ramps
+ * over a few blocks, and each layer fades out and back in over EDGE_FADE samples where its audio
+ * jumps (the loop boundary for the whole track, the edges of active regions for the active layer).
+ * Per sample that leaves a compare and an add per envelope, and a multiply(-accumulate) per layer.
+ * No floating point: the M0+ doesn't have an FPU.
+ */
+
+#define GAIN_SHIFT 15
+#define GAIN_UNITY (1 << GAIN_SHIFT)         // also the largest gain, so the mix can't overflow 32 bits
+#define GAIN_RAMP_PER_BLOCK (GAIN_UNITY / 8) // how far a gain moves per block towards a new setting
+#define EDGE_FADE 32                         // samples to fade over at loop and region edges. 0 turns the fades off
+
+#define ENVELOPE_FRAC 8        // extra fraction bits for the ramps, so short ones don't lose their slope
+#define ENVELOPE_MAX_POINTS 16 // breakpoints per block. Any more are dropped (the fades get steeper)
+#define MAX_FADE_EDGES 8
+
+// a place in the loop where a layer fades out (up to `position`) or back in (from `position`)
+struct fade_edge_t {
+    uint32_t position;
+    bool rising;
+};
+
+// how much of a layer is let through at loop position `p`, by the fades around `edges`, in Q15
+inline int32_t edge_factor(const fade_edge_t* edges, uint32_t count, uint32_t p, uint32_t loop_length) {
+    int32_t factor = GAIN_UNITY;
+    for (uint32_t i = 0; i < count; i++) {
+        // samples since the layer came back in, or until it goes out
+        uint32_t d = edges[i].rising ? p + loop_length - edges[i].position : edges[i].position + loop_length - 1 - p;
+        d %= loop_length;
+        if (d < EDGE_FADE) {
+            int32_t f = d * GAIN_UNITY / EDGE_FADE;
+            if (f < factor) factor = f;
+        }
+    }
+    return factor;
+}
+
+// a piecewise-linear gain over one block, stepped once per sample
+struct envelope_t {
+    int32_t value = GAIN_UNITY << ENVELOPE_FRAC;
+    int32_t step = 0;
+    uint32_t index = 0;
+    uint32_t next = UINT32_MAX; // index of the next breakpoint
+    uint32_t point = 0;
+    uint32_t points = 0;
+    uint32_t at[ENVELOPE_MAX_POINTS];
+    int32_t level[ENVELOPE_MAX_POINTS];
+
+    // the gain for the next sample. Past the last breakpoint it stays where it is
+    inline int32_t tick() {
+        if (index == next) next_segment();
+        index++;
+        int32_t gain = value >> ENVELOPE_FRAC;
+        value += step;
+        return gain;
+    }
+
+    void next_segment() {
+        value = level[point] << ENVELOPE_FRAC;
+        point++;
+        if (point < points) {
+            step = ((level[point] - level[point - 1]) << ENVELOPE_FRAC) / (int32_t) (at[point] - at[point - 1]);
+            next = at[point];
+        } else {
+            step = 0;
+            next = UINT32_MAX;
+        }
+    }
+
+    void add_point(uint32_t i) {
+        if (points >= ENVELOPE_MAX_POINTS - 1) return; // the last slot is kept for the block end
+        uint32_t j = points;
+        while (j > 0 && at[j - 1] > i) {
+            at[j] = at[j - 1];
+            j--;
+        }
+        if (j > 0 && at[j - 1] == i) {
+            // already there, undo the shift
+            for (; j < points; j++) at[j] = at[j + 1];
+            return;
+        }
+        at[j] = i;
+        points++;
+    }
+
+    /**
+     * Plan the next `length` samples, starting at loop position `start`. The gain moves in a
+     * straight line from `from` to `to` over them, and fades around `edges`. Between breakpoints
+     * the product of the two is interpolated, which is close enough for fades this short.
+    */
+    void plan(uint32_t start, uint32_t length, uint32_t loop_length, int32_t from, int32_t to,
+              const fade_edge_t* edges, uint32_t edge_count) {
+        points = 0;
+        add_point(0);
+        if (loop_length > 0 && EDGE_FADE > 0) {
+            for (uint32_t e = 0; e < edge_count; e++) {
+                // the corners of the fade: the jump, and both ends of the ramp
+                uint32_t p = edges[e].position;
+                uint32_t corners[3];
+                uint32_t n = 0;
+                if (edges[e].rising) {
+                    corners[n++] = p + loop_length - 1;
+                    corners[n++] = p;
+                    corners[n++] = p + EDGE_FADE;
+                } else {
+                    corners[n++] = p + loop_length - 1 - EDGE_FADE;
+                    corners[n++] = p + loop_length - 1;
+                    corners[n++] = p;
+                }
+                for (uint32_t c = 0; c < n; c++) {
+                    uint32_t i = (corners[c] + loop_length - start % loop_length) % loop_length;
+                    if (i > 0 && i < length) add_point(i);
+                }
+            }
+        }
+        at[points++] = length;
+
+        for (uint32_t i = 0; i < points; i++) {
+            int32_t gain = from + (to - from) * (int32_t) at[i] / (int32_t) length;
+            if (loop_length > 0 && EDGE_FADE > 0) {
+                gain = gain * edge_factor(edges, edge_count, (start + at[i]) % loop_length, loop_length) >> GAIN_SHIFT;
+            }
+            level[i] = gain;
+        }
+        point = 0;
+        index = 0;
+        next = 0;
+    }
+};
+
+// one layer's gain setting, and where its ramp towards it has got to
+struct layer_gain_t {
+    int32_t target = GAIN_UNITY;
+    int32_t gain = GAIN_UNITY; // at the start of the block that is playing
+    envelope_t envelope;
+
+    // move `gain` one block's worth towards the target. Returns where it was, so the block that is
+    // starting ramps from there to `gain`
+    inline int32_t ramp() {
+        int32_t from = gain;
+        if (gain < target) gain = gain + GAIN_RAMP_PER_BLOCK < target ? gain + GAIN_RAMP_PER_BLOCK : target;
+        if (gain > target) gain = gain - GAIN_RAMP_PER_BLOCK > target ? gain - GAIN_RAMP_PER_BLOCK : target;
+        return from;
+    }
+};
+
+inline int16_t saturate16(int32_t x) {
+    if (x > INT16_MAX) return INT16_MAX;
+    if (x < INT16_MIN) return INT16_MIN;
+    return x;
+}
+
+// both layers of one sample, see the top of the file. `active_gain` is 0 where the active layer isn't playing
+inline int16_t mix_layers(int16_t main, int16_t active, int32_t main_gain, int32_t active_gain) {
+    int32_t sum = ((int32_t) main << GAIN_SHIFT) + active * active_gain;
+    return saturate16((sum >> GAIN_SHIFT) * main_gain >> GAIN_SHIFT);
+}
+
+// what an old active region leaves in the main layer when it's committed
+inline int16_t commit_layers(int16_t main, int16_t active, int32_t active_gain) {
+    return saturate16(main + (active * active_gain >> GAIN_SHIFT));
+}
+
+#endif
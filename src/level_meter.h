@@ -0,0 +1,100 @@
+#ifndef LEVEL_METER_H
+#define LEVEL_METER_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+/*
+ * Level meters: peak, RMS and clip count for the input, each layer of each track, each track's mix
+ * and the output (the METER_ indices in auto_looper.h). The audio ISR feeds each meter the sample it
+ * already has in hand while mixing, so there is no extra pass over the audio: per sample that's a
+ * compare for the peak, a multiply-accumulate for the RMS and a compare for clipping.
+ *
+ * A sample at full scale counts as clipped. Everything that saturates (add(), the layer mix, commits)
+ * pins to INT16_MAX/INT16_MIN, so clipping that used to be silent shows up in the meter of whatever
+ * it ended up in.
+ *
+ * Every METER_WINDOW_BLOCKS blocks the ISR publishes the window it has added up, behind a sequence
+ * number that is odd while the copy is being written. The main loop copies the window out without
+ * turning interrupts off, and tries again if the audio ISR published in the middle of the copy. Both
+ * run on the same core, so only the compiler has to be kept from reordering the copies.
+ */
+
+#define METER_WINDOW_BLOCKS 19 // blocks per published window: about 100 ms at 48 kHz
+
+struct meter_t {
+    uint32_t peak;  // largest magnitude
+    uint32_t clips; // samples at full scale
+    uint64_t sum_squares;
+
+    inline void add(int16_t x) {
+        uint32_t magnitude = x < 0 ? -x : x;
+        if (magnitude > peak) peak = magnitude;
+        if (magnitude >= INT16_MAX) clips++;
+        sum_squares += (uint32_t) (x * x);
+    }
+};
+
+#define METER_FLOOR_DB -99.9f // what silence reads as
+
+// levels relative to full scale, for printing. Float: only the main loop calls these
+inline float meter_peak_db(const meter_t& meter) {
+    return meter.peak ? 20 * log10f(meter.peak / 32768.0f) : METER_FLOOR_DB;
+}
+
+inline float meter_rms_db(const meter_t& meter, uint32_t samples) {
+    if (meter.sum_squares == 0 || samples == 0) return METER_FLOOR_DB;
+    return 10 * log10f((float) meter.sum_squares / samples / (32768.0f * 32768.0f));
+}
+
+struct meter_window_t {
+    uint32_t window;  // counts up from 1
+    uint32_t samples; // every meter covers all of them. A layer that isn't playing adds silence
+    meter_t meters[NUM_METERS];
+};
+
+struct level_meters_t {
+    meter_t current[NUM_METERS]; // the window being added up. Only the audio ISR touches it
+    uint32_t blocks = 0;
+    meter_window_t published = {};
+    volatile uint32_t sequence = 0;
+
+    level_meters_t() {
+        memset(current, 0, sizeof(current));
+    }
+
+    inline void add(uint32_t meter, int16_t x) {
+        current[meter].add(x);
+    }
+
+    // called by the audio ISR after the last sample of each block
+    inline void end_block(uint32_t block_size) {
+        if (++blocks < METER_WINDOW_BLOCKS) return;
+        sequence++;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        published.window++;
+        published.samples = blocks * block_size;
+        memcpy(published.meters, current, sizeof(current));
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        sequence++;
+        memset(current, 0, sizeof(current));
+        blocks = 0;
+    }
+
+    // copy out the last published window. Returns false if it's still window `last` (or there isn't one yet)
+    bool read(meter_window_t* out, uint32_t last) const {
+        uint32_t before;
+        do {
+            before = sequence;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            memcpy(out, (const void*) &published, sizeof(published));
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        } while ((before & 1) || before != sequence);
+        return out->window != last && out->window != 0;
+    }
+};
+
+#endif
@@ -0,0 +1,872 @@
+#include "pico/stdlib.h"
+
+#include "ice_sram.h"
+
+#include "auto_looper.h"
+
+/*
+ * The looper engine: every track's state machine, the per-sample mixing and the PSRAM refills.
+ * Nothing in here touches the audio or USB hardware, so it also builds on the host (see host/).
+ */
+
+// used for debugging
+const char* state_names[] = {
+    "IDLE", 
+    "FIRST_RECORD", "FIRST_TMP_RECORD", "TEMP_RECORD", "RECORD", 
+    "FIRST_PLAYBACK", "PLAY", "PLAYBACK1",
+    "FIRST_STOP", "STOPPED"
+};
+
+static looper_context_t main_context;
+LOOPER_CONTEXT_LOCAL looper_context_t* looper_ctx = &main_context;
+
+static_assert(sizeof(looper_context_t) < 200 * 1024, "not enough SRAM for this many tracks");
+
+// written over the stale part of a silent block when only some of it gets real audio
+static const int16_t silent_block[BUFFER_SIZE][2] = {};
+
+// one contiguous PSRAM transfer
+static void transfer_run(track_t& t, uint start, int16_t (*data)[2], uint size, bool write) {
+    if (size == 0) return;
+    uint32_t psram_address = t.psram_base + start * 4;
+    if (write) {
+        //printf("Writing to address %d, writing %d samples\n", start, size);
+        ice_sram_write_blocking(psram_address, (uint8_t*) data, size * 4);
+        looper_ctx->psram_stats.bytes_written += size * 4;
+    } else {
+        //printf("Reading from address %d, reading %d samples\n", start, size);
+        ice_sram_read_blocking(psram_address, (uint8_t*) data, size * 4);
+        looper_ctx->psram_stats.bytes_read += size * 4;
+    }
+}
+
+/**
+ * Transfer one span that doesn't wrap, leaving out the blocks the silence map says are silent.
+ * Runs of blocks that aren't silent still go out as a single transfer.
+*/
+static void transfer_span(track_t& t, uint start, int16_t (*data)[2], uint size, bool write) {
+    silence_map_t& silence = t.looper.silence;
+    uint end = start + size;
+    uint run_start = start;
+    int16_t (*run_data)[2] = data;
+
+    while (start < end) {
+        uint block = start / BUFFER_SIZE;
+        uint block_start = block * BUFFER_SIZE;
+        uint piece = BUFFER_SIZE - (start - block_start);
+        if (piece > end - start) piece = end - start;
+
+        bool skip = false;
+        if (!write) {
+            skip = silence.is_silent(block);
+            if (skip) memset(data, 0, piece * 4);
+        } else if (silence_map_t::is_quiet(data, piece) && (silence.is_silent(block) || piece == BUFFER_SIZE)) {
+            silence.mark(block, true);
+            skip = true;
+        } else if (silence.is_silent(block)) {
+            // only part of the block is written, so the stale rest of it has to be cleared first
+            uint block_end = block_start + BUFFER_SIZE;
+            transfer_run(t, block_start, (int16_t (*)[2]) silent_block, start - block_start, true);
+            transfer_run(t, start + piece, (int16_t (*)[2]) silent_block, block_end - start - piece, true);
+            silence.mark(block, false);
+        }
+
+        if (skip) {
+            looper_ctx->psram_stats.silent_skipped++;
+            transfer_run(t, run_start, run_data, start - run_start, write);
+            run_start = start + piece;
+            run_data = data + piece;
+        }
+        start += piece;
+        data += piece;
+    }
+    transfer_run(t, run_start, run_data, end - run_start, write);
+}
+
+/**
+ * Transfer `size` samples between PSRAM and a staging buffer, starting at loop position `start`.
+ * Transfers that run past the loop end are split so that they wrap around to the loop start.
+*/
+void psram_transfer(track_t& t, uint start, int16_t (*data)[2], uint size, bool write) {
+    psram_span_t spans[2];
+    uint num_spans = split_block(start, size, t.looper.loop_length, spans);
+    for (uint i = 0; i < num_spans; i++) {
+        uint span_start = spans[i].start;
+        int16_t (*span_data)[2] = data + spans[i].offset;
+        uint span_size = spans[i].size;
+
+        // the loop head is written through to SRAM, and read back from there
+        if (span_start < LOOP_HEAD_SIZE) {
+            uint head_size = LOOP_HEAD_SIZE - span_start;
+            if (head_size > span_size) head_size = span_size;
+            if (write) {
+                memcpy(t.looper.head[span_start], span_data, head_size * 4);
+            } else {
+                memcpy(span_data, t.looper.head[span_start], head_size * 4);
+                looper_ctx->psram_stats.head_hits++;
+                span_start += head_size;
+                span_data += head_size;
+                span_size -= head_size;
+            }
+        }
+        transfer_span(t, span_start, span_data, span_size, write);
+    }
+}
+
+/**
+ * Commit what the old active regions still hold in one block of the loop, straight in PSRAM, so the
+ * active layer can be overwritten there. Goes through the PSRAM access buffer, so it has to come
+ * before the refill. The block that is playing is left to the audio path, which commits it as it goes.
+*/
+static void commit_old_block(track_t& t, uint block) {
+    looper_t& looper = t.looper;
+    if (!looper.old_block_pending(block) || block == looper.buffer_start[LOOP_BUFFER] / BUFFER_SIZE) return;
+
+    uint start = block * BUFFER_SIZE;
+    uint size = looper.loop_length - start < BUFFER_SIZE ? looper.loop_length - start : BUFFER_SIZE;
+    int16_t (*data)[2] = looper.buffer[PSRAM_ACCESS_BUFFER];
+    psram_transfer(t, start, data, size, false);
+    for (uint i = 0; i < size; i++) {
+        int32_t gain;
+        if (looper.in_old_active_region(start + i, &gain)) {
+            // at the level it was playing at
+            data[i][MAIN_SAMPLE] = commit_layers(data[i][MAIN_SAMPLE], data[i][ACTIVE_SAMPLE], gain);
+        }
+    }
+    psram_transfer(t, start, data, size, true);
+    looper.old_block_committed(block, looper.old_active_blocks.size());
+}
+
+void write_routine(track_t& t) {
+    looper_t& looper = t.looper;
+    uint write_size = looper.buffer_offset[PSRAM_ACCESS_BUFFER];
+    uint write_location = looper.buffer_start[PSRAM_ACCESS_BUFFER];
+    // a block that was only played back is still identical to PSRAM, so it doesn't need writing back
+    if (write_size > 0 && looper.dirty[PSRAM_ACCESS_BUFFER]) {
+        t.saving = false;
+        psram_transfer(t, write_location, looper.buffer[PSRAM_ACCESS_BUFFER], write_size, true);
+        looper_ctx->psram_stats.writebacks++;
+    } else if (write_size > 0) {
+        looper_ctx->psram_stats.writebacks_skipped++;
+    }
+
+    // TODO: read scratch buffer if needed, using old active buffer as well!
+    // the merge is background work, so it skips a refill while the track is missing blocks. Never
+    // two in a row, or sustained contention could keep an overdub from ever finishing
+    bool defer_merge = looper.fallback && !looper.merge_deferred;
+    looper.merge_deferred = defer_merge;
+    if (looper.scratch_buffer_size == SCRATCH_BUFFER_SIZE && !defer_merge) {
+        t.saving = false;
+        // read from psram, mix with scratch buffer, write back to psram.
+        // old active regions under it are committed to the main layer first, a whole block at a time
+        uint start_time = (looper.scratch_buffer_start + looper.scratch_buffer_ptr) % looper.loop_length;
+        commit_old_block(t, start_time / BUFFER_SIZE);
+        commit_old_block(t, (start_time + BUFFER_SIZE - 1) % looper.loop_length / BUFFER_SIZE);
+        psram_transfer(t, start_time, looper.buffer[PSRAM_ACCESS_BUFFER], BUFFER_SIZE, false);
+
+        for (int i = 0; i < BUFFER_SIZE; i++) {
+            // mix scratch buffer into active buffer
+            looper.buffer[PSRAM_ACCESS_BUFFER][i][ACTIVE_SAMPLE] = looper.scratch_buffer[looper.scratch_buffer_ptr + i];
+        }
+
+        // write back to psram
+        psram_transfer(t, start_time, looper.buffer[PSRAM_ACCESS_BUFFER], BUFFER_SIZE, true);
+
+        looper.scratch_buffer_ptr += BUFFER_SIZE;
+        if (looper.scratch_buffer_ptr >= looper.scratch_buffer_size) {
+            looper.scratch_buffer_size = 0;
+            looper.scratch_buffer_ptr = 0;
+            printf("Finished writing scratch buffer\n");
+        }
+    }
+
+    looper.buffer_offset[PSRAM_ACCESS_BUFFER] = 0;
+    looper.buffer_start[PSRAM_ACCESS_BUFFER] = t.read_location;
+    psram_transfer(t, t.read_location, looper.buffer[PSRAM_ACCESS_BUFFER], BUFFER_SIZE, false);
+    looper.dirty[PSRAM_ACCESS_BUFFER] = false;
+    t.signal_write = false;
+}
+
+/**
+ * Transfer scheduler. Services every track that has asked for a refill, back to back, so that
+ * all tracks' PSRAM traffic for a block goes out in a single burst.
+*/
+void service_tracks() {
+    looper_ctx->signal_write = false;
+    for (track_t& t : looper_ctx->tracks) {
+        if (t.signal_write) {
+            write_routine(t);
+        }
+    }
+    looper_ctx->psram_window = true;
+}
+
+void footswitch_changed(track_t& t, bool state) {
+    if (state) {
+        t.button_released = true;
+        t.button_pressed = false;
+    } else {
+        t.button_pressed = true;
+    }
+}
+
+void reset_button(track_t& t) {
+    t.button_released = false;
+    t.button_pressed = false;
+    t.last_time = time_us_64();
+}
+
+inline bool time_up(track_t& t) {
+    return time_us_64() - t.last_time > 660000;
+}
+
+/**
+ * True when starting or resuming the track now keeps its buffer swaps lined up with the other
+ * tracks. A track whose loop is a whole number of master loops (or that has no loop yet) also waits
+ * for the master to reach the same place in its loop, so it starts at the master's loop start and
+ * picks up again where it was stopped, instead of drifting by however many blocks it was held.
+*/
+inline bool in_phase(track_t& t) {
+    looper_t& looper = t.looper;
+    if (looper.prefetch.block_rate != PLAYBACK_RATE_UNITY) return true; // varispeed swaps never line up
+    if (looper.buffer_offset[LOOP_BUFFER] != looper_ctx->block_clock) return false;
+
+    int master_time = looper_ctx->master_time;
+    uint master_length = MASTER_TRACK.looper.loop_length;
+    if (&t == &MASTER_TRACK || master_time < 0 || looper.loop_length % master_length != 0) return true;
+    return looper.loop_time % master_length == (uint) master_time;
+}
+
+// a press that starts or resumes the track is held on to until the track is in phase
+static inline bool start_when_in_phase(track_t& t) {
+    if (t.button_pressed && t.button_released) t.cued = true;
+    return t.cued && in_phase(t);
+}
+
+/**
+ * Finish the first recording of a track. The master track sets the loop length; the other tracks
+ * are locked to the nearest whole multiple of it, so a slave may keep recording for a while after
+ * the button press. Returns false while that is still happening.
+*/
+bool lock_loop_length(track_t& t) {
+    looper_t& looper = t.looper;
+    looper_t& master = MASTER_TRACK.looper;
+    bool master_locked = &t != &MASTER_TRACK && master.loop_length > 0 && MASTER_TRACK.state != FIRST_RECORD;
+
+    if (!master_locked) {
+        looper.loop_length = (looper.loop_length / BUFFER_SIZE) * BUFFER_SIZE; // TODO: tmp
+        return true;
+    }
+
+    if (looper.record_until == 0) {
+        uint multiple = (looper.loop_length + master.loop_length / 2) / master.loop_length;
+        if (multiple == 0) multiple = 1;
+        while (multiple > 1 && multiple * master.loop_length > PSRAM_TRACK_SAMPLES) multiple--;
+        looper.record_until = multiple * master.loop_length;
+        printf("Track %d locked to %d times the master loop\n", t.id, multiple);
+    }
+
+    if (looper.loop_length < looper.record_until) {
+        return false;
+    }
+    looper.loop_length = looper.record_until;
+    return true;
+}
+
+// for debugging
+inline const char* get_state_type(state_t state) {
+    if (state == 0) return "Waiting";
+    if (state >= 1 && state <= 4) return "Recording";
+    if (state >= 5 && state <= 7) return "Playing";
+    if (state >= 8 && state <= 9) return "Stopped";
+    return "Unknown";
+}
+
+inline void update_state(track_t& t, state_t new_state) {
+    looper_t& looper = t.looper;
+    state_t& state = t.state;
+    state = new_state;
+
+    if (state == IDLE) {
+        int rate = looper.prefetch.rate; // the playback rate is a setting, so it survives the reset
+        looper = looper_t(); // reset the looper
+        t.saving = false;    // whatever a save was copying is gone
+        looper.prefetch.rate = rate;
+    }
+
+    if (state == RECORD) {
+        if (looper.undo_mode) {
+            // we don't need to save the old active region, so we can just overwrite it
+            looper.set_undo_mode(false);
+        } else if (looper.active_size > 0) {
+            // mark the old active region for writing. The first overdub has none, and an empty one would never be erased
+            int32_t gain = t.gain[ACTIVE_SAMPLE].target;
+            looper.add_old_active_region(looper.active_start, looper.active_size, gain);
+            if (looper.commit_block) {
+                // the block that is playing has already gone past part of the region. Commit that part
+                // now, so the whole block is done for the region at the end of the block
+                uint block_start = looper.buffer_start[LOOP_BUFFER];
+                for (uint i = 0; i < looper.buffer_offset[LOOP_BUFFER]; i++) {
+                    if (!looper.in_region(looper.active_start, looper.active_size, block_start + i)) continue;
+                    int16_t* sample = looper.buffer[LOOP_BUFFER][i];
+                    sample[MAIN_SAMPLE] = commit_layers(sample[MAIN_SAMPLE], sample[ACTIVE_SAMPLE], gain);
+                    looper.dirty[LOOP_BUFFER] = true;
+                }
+                looper.commit_regions = looper.old_active_start.size();
+            }
+        }
+
+        if (looper.scratch_buffer_size != SCRATCH_BUFFER_SIZE) {
+            printf("Error: scratch buffer not full\n");
+        }
+        looper.active_start = (looper.loop_time - looper.scratch_buffer_size + looper.loop_length) % looper.loop_length;
+        looper.active_size = looper.scratch_buffer_size;
+
+        printf("New active region: %d, %d\n", looper.active_start, looper.active_size);
+    }
+
+    if (state == FIRST_TMP_RECORD || state == TEMP_RECORD) {
+        // reset the scratch buffer
+        looper.scratch_buffer_start = looper.loop_time;
+        looper.scratch_buffer_size = 0;
+        looper.scratch_buffer_ptr = 0;
+    }
+
+    // started by a cued press, or closed by the master lock, after the footswitch came back up: the next press counts,
+    // and it isn't taken for a hold
+    bool button_up = (t.cued || state == FIRST_PLAYBACK) && t.button_released && !t.button_pressed;
+    reset_button(t);
+    if (button_up) t.button_released = true;
+    t.cued = false;
+    printf("Track %d state changed to %s\n", t.id, state_names[state]);
+    printf("Current status: %s\n\n", get_state_type(state));
+}
+
+void set_playback_rate(int rate) {
+    for (track_t& t : looper_ctx->tracks) {
+        t.looper.prefetch.set_rate(rate);
+    }
+}
+
+// recording and region commits need every sample to be visited exactly once, at 1x forward
+static inline bool varispeed_allowed(track_t& t) {
+    looper_t& looper = t.looper;
+    state_t state = t.state;
+    return (state == PLAY || state == PLAYBACK1 || state == FIRST_PLAYBACK)
+        && looper.old_active_start.empty()
+        && looper.active_size != looper.loop_length;
+}
+
+// tell the main loop to write back the PSRAM access buffer and refill it from read_location.
+// Never called while the previous refill is still pending (see missed_block)
+static inline void signal_prefetch(track_t& t) {
+    t.signal_write = true;
+    looper_ctx->signal_write = true;
+}
+
+/**
+ * The first recording has just been closed. It is cut off at the end of the last whole block, so
+ * the block that is playing lies past the new loop end. It was filled from the loop start, so it
+ * plays on from there: loop_time is moved to that position, and the block after it is fetched
+ * instead of the loop start again. What was recorded into the block before the close is past the
+ * loop end, so the block isn't written back: the loop is the first loop_length samples recorded.
+ * A refill the main loop had already picked up still lands the loop start; the next swap sees
+ * the wrong block and fetches the right one as if it had been late (see missed_block).
+*/
+static void close_loop(track_t& t) {
+    looper_t& looper = t.looper;
+    uint block_start = looper.buffer_start[LOOP_BUFFER] % looper.loop_length;
+    looper.loop_time = (block_start + looper.buffer_offset[LOOP_BUFFER]) % looper.loop_length;
+    if (looper.buffer_start[LOOP_BUFFER] >= looper.loop_length) looper.dirty[LOOP_BUFFER] = false;
+    t.read_location = prefetch_t::next_block(block_start, looper.loop_length, PLAYBACK_RATE_UNITY);
+    if (!t.signal_write) signal_prefetch(t); // a refill that is still pending picks up the new location
+}
+
+// smooth over a jump in the track's output, starting from whatever it played last
+static inline void start_fade(looper_t& looper) {
+    looper.fade_from = looper.last_out;
+    looper.fade_left = OVERRUN_FADE;
+}
+
+static inline int16_t fade_output(looper_t& looper, int16_t out) {
+    if (looper.fade_left > 0) {
+        out = looper.fade_from + (out - looper.fade_from) * (OVERRUN_FADE - looper.fade_left) / OVERRUN_FADE;
+        looper.fade_left--;
+    }
+    looper.last_out = out;
+    return out;
+}
+
+/**
+ * Plan both layers' gains for the block that starts now. The whole track fades around the loop
+ * boundary, and the active layer around the edges of the regions it plays in. The end of a region
+ * that is still being recorded isn't known yet, so that doesn't fade. Old active regions play at
+ * the gain they kept, so their fades are planned on their own.
+*/
+static void plan_gains(track_t& t) {
+    looper_t& looper = t.looper;
+    uint loop_length = t.state == FIRST_RECORD ? 0 : looper.loop_length; // no edges while it's still growing
+
+    fade_edge_t loop_edges[2] = {{0, true}, {loop_length, false}};
+    fade_edge_t region_edges[2];
+    uint count = 0;
+    if (loop_length > 0 && looper.active_size > 0 && looper.active_size < loop_length) {
+        region_edges[count++] = {looper.active_start, true};
+        if (t.state != RECORD) {
+            region_edges[count++] = {(looper.active_start + looper.active_size) % loop_length, false};
+        }
+    }
+    fade_edge_t old_edges[MAX_FADE_EDGES];
+    uint old_count = 0;
+    for (uint i = 0; loop_length > 0 && i < looper.old_active_start.size() && old_count + 2 <= MAX_FADE_EDGES; i++) {
+        old_edges[old_count++] = {looper.old_active_start[i], true};
+        old_edges[old_count++] = {(looper.old_active_start[i] + looper.old_active_size[i]) % loop_length, false};
+    }
+
+    layer_gain_t& main = t.gain[MAIN_SAMPLE];
+    layer_gain_t& active = t.gain[ACTIVE_SAMPLE];
+    int32_t from = main.ramp();
+    main.envelope.plan(looper.loop_time, BUFFER_SIZE, loop_length, from, main.gain, loop_edges, 2);
+    from = active.ramp();
+    active.envelope.plan(looper.loop_time, BUFFER_SIZE, loop_length, from, active.gain, region_edges, count);
+    t.old_region_fade.plan(looper.loop_time, BUFFER_SIZE, loop_length, GAIN_UNITY, GAIN_UNITY, old_edges, old_count);
+}
+
+// varispeed blocks don't line up with loop positions, so only the gain settings ramp there
+static void plan_gains_varispeed(track_t& t) {
+    for (layer_gain_t& layer : t.gain) {
+        int32_t from = layer.ramp();
+        layer.envelope.plan(0, BUFFER_SIZE, 0, from, layer.gain, nullptr, 0);
+    }
+}
+
+void set_layer_gain(track_t& t, uint layer, int32_t gain) {
+    if (gain < 0) gain = 0;
+    if (gain > GAIN_UNITY) gain = GAIN_UNITY;
+    t.gain[layer].target = gain;
+}
+
+/**
+ * Called at a 1x block boundary when the refill for the next block isn't done yet, and at every
+ * boundary after that until the track is back in step. The block that was just played is played
+ * again (or silence, see OVERRUN_REPEAT) while loop_time carries on, and nothing is recorded into it.
+ * Once the late refill is in, its block's time has passed, so one more refill is issued for the
+ * block the loop will have reached by then. The track comes back exactly in step with loop_time
+ * and the other tracks, at the cost of at least two blocks of fallback.
+*/
+static void missed_block(track_t& t) {
+    looper_t& looper = t.looper;
+    bool first_record = t.state == FIRST_RECORD;
+
+    uint position; // where the block that should play now comes from
+    if (!looper.fallback) {
+        position = first_record ? looper.buffer_start[LOOP_BUFFER] + BUFFER_SIZE : t.read_location;
+        looper.fallback = true;
+    } else if (first_record) {
+        position = looper.fallback_position + BUFFER_SIZE;
+    } else {
+        position = prefetch_t::next_block(looper.fallback_position, looper.loop_length, PLAYBACK_RATE_UNITY);
+    }
+    looper.fallback_position = position;
+    looper.overload = OVERLOAD_BLOCKS;
+    start_fade(looper);
+
+    if (t.signal_write) {
+        looper_ctx->psram_stats.overruns++; // still waiting for PSRAM
+    } else if (first_record || looper.buffer_start[PSRAM_ACCESS_BUFFER] == position) {
+        // back in step. The repeated block goes back to PSRAM as it was when it was first played
+        looper.fallback = false;
+        looper.which = !looper.which;
+        if (first_record) {
+            looper.buffer_start[LOOP_BUFFER] = position;
+            t.read_location = 0;
+        } else {
+            t.read_location = prefetch_t::next_block(position, looper.loop_length, PLAYBACK_RATE_UNITY);
+        }
+        signal_prefetch(t);
+        return;
+    } else {
+        // the late block is in, but too late to play. Fetch the one after this one instead
+        t.read_location = prefetch_t::next_block(position, looper.loop_length, PLAYBACK_RATE_UNITY);
+        signal_prefetch(t);
+    }
+    looper_ctx->psram_stats.fallback_blocks++;
+    looper.buffer_offset[LOOP_BUFFER] = 0;
+}
+
+/**
+ * Called when the block in LOOP_BUFFER has been used up. Picks the rate of the next block and
+ * the block to prefetch after it. Turning around doesn't swap buffers: the current block is
+ * played again in the new direction, so only the prefetch has to be redone.
+*/
+static void end_of_block(track_t& t) {
+    looper_t& looper = t.looper;
+    int rate = varispeed_allowed(t) ? looper.prefetch.rate : PLAYBACK_RATE_UNITY;
+    bool was_unity = looper.prefetch.block_rate == PLAYBACK_RATE_UNITY;
+    bool bounce = looper.prefetch.changes_direction(rate);
+
+    if (!bounce) {
+        looper.which = !looper.which; // swap buffers. The other buffer must contain the next audio to be played
+    }
+    looper.prefetch.block_rate = rate;
+
+    if (rate == PLAYBACK_RATE_UNITY) {
+        // the 1x path indexes with buffer_offset and counts loop_time itself
+        if (bounce) looper.buffer_offset[LOOP_BUFFER] = 0;
+        if (!was_unity) {
+            looper.loop_time = looper.buffer_start[LOOP_BUFFER];
+            // an overdub that was started during the varispeed block records from here
+            if (t.state == TEMP_RECORD || t.state == FIRST_TMP_RECORD) looper.scratch_buffer_start = looper.loop_time;
+        }
+    } else if (was_unity) {
+        looper.prefetch.phase = 0;
+    }
+    t.read_location = prefetch_t::next_block(looper.buffer_start[LOOP_BUFFER], looper.loop_length, rate);
+}
+
+/**
+ * Playback at any rate other than 1x forward. The staging buffer is only read here; recording
+ * and region commits are held off until the loop is back at 1x (see varispeed_allowed).
+*/
+static int16_t get_next_sample_varispeed(track_t& t) {
+    looper_t& looper = t.looper;
+    uint index = looper.prefetch.index();
+    looper.loop_time = looper.buffer_start[LOOP_BUFFER] + index;
+
+    int16_t main = looper.buffer[LOOP_BUFFER][index][MAIN_SAMPLE];
+    int16_t active = looper.buffer[LOOP_BUFFER][index][ACTIVE_SAMPLE];
+    int32_t main_gain = t.gain[MAIN_SAMPLE].envelope.tick();
+    int32_t active_gain = t.gain[ACTIVE_SAMPLE].envelope.tick();
+
+    int32_t old_gain;
+    bool in_old_active_region = looper.in_old_active_region(&old_gain);
+    if (in_old_active_region) active_gain = old_gain;
+    bool play_active = (!looper.undo_mode && looper.in_active_region()) || in_old_active_region;
+    int16_t mixed = mix_layers(main, active, main_gain, play_active ? active_gain : 0);
+    looper_ctx->level_meters.add(METER_TRACK(t.id, MAIN_SAMPLE), main);
+    if (play_active) looper_ctx->level_meters.add(METER_TRACK(t.id, ACTIVE_SAMPLE), active);
+
+    // an overdub started here doesn't record until the loop is back at 1x (see end_of_block), since
+    // the scratch buffer has to line up with loop positions
+    mixed = fade_output(looper, mixed);
+    looper_ctx->level_meters.add(METER_TRACK(t.id, METER_MIX), mixed);
+
+    if (looper.prefetch.advance()) {
+        if (looper.overload > 0) looper.overload--;
+        if (t.signal_write) {
+            // the next block is late: play this one again. Positions come from the staging
+            // buffer here, so the track simply carries on one block behind
+            looper_ctx->psram_stats.overruns++;
+            looper_ctx->psram_stats.fallback_blocks++;
+            looper.overload = OVERLOAD_BLOCKS;
+            start_fade(looper);
+        } else {
+            end_of_block(t);
+            signal_prefetch(t);
+        }
+        plan_gains_varispeed(t);
+    }
+
+    return mixed;
+}
+
+/**
+ * Run one track's state machine and get its contribution to the next sample (without `current`)
+*/
+static int16_t track_next_sample(track_t& t, int16_t current) {
+    looper_t& looper = t.looper;
+    state_t& state = t.state;
+    bool& button_pressed = t.button_pressed;
+    bool& button_released = t.button_released;
+
+    if (t.loading) {
+        return 0;
+    }
+
+    if (state == IDLE) {
+        if (start_when_in_phase(t)) {
+            update_state(t, FIRST_RECORD);
+        }
+    }
+
+    if (state == FIRST_RECORD) {
+        bool full = looper.loop_length >= PSRAM_TRACK_SAMPLES;
+        if ((button_pressed && button_released) || looper.record_until > 0 || full) {
+            if (full) printf("Track %d is out of PSRAM\n", t.id);
+            if (lock_loop_length(t) || full) {
+                printf("Loop length: %d\n\n", looper.loop_length);
+                close_loop(t);
+                update_state(t, FIRST_PLAYBACK);
+            } else if (button_pressed) {
+                reset_button(t); // keep recording until the loop is a multiple of the master
+            }
+        }
+    }
+
+    if (state == FIRST_PLAYBACK) {
+        if (button_pressed && button_released) {
+            if (time_up(t)) {
+                update_state(t, FIRST_TMP_RECORD);
+            } else {
+                update_state(t, FIRST_STOP);
+            }
+        } else if (!button_released && time_up(t)) {
+            update_state(t, IDLE);
+        }
+    }
+
+    if (state == FIRST_STOP) {
+        if (start_when_in_phase(t)) {
+            update_state(t, FIRST_PLAYBACK);
+        } else if (button_released) {
+
+        } else if (time_up(t)) {
+            update_state(t, IDLE);
+        }
+    }
+
+    if (state == FIRST_TMP_RECORD) {
+        bool done = looper.scratch_buffer_size >= SCRATCH_BUFFER_SIZE;
+        if (!button_pressed && !button_released && done) {
+            // invalidate tmp buffer
+            update_state(t, IDLE);
+        } else if (button_pressed && button_released && !done) {
+            // invalidate tmp buffer
+            update_state(t, STOPPED);
+        } else if (done) {
+            update_state(t, RECORD);
+        }
+    }
+
+    if (state == RECORD) {
+        // scratch buffer must be flushed before finishing recording
+        if (button_pressed && looper.scratch_buffer_size == 0/* && button_released*/) {
+            update_state(t, PLAY);
+        }
+    }
+
+    if (state == PLAY) {
+        if (button_pressed /* && button_released*/) {
+            if (time_up(t)) {
+                update_state(t, TEMP_RECORD);
+            } else {
+                update_state(t, STOPPED);
+            }
+        } else if (!button_released && time_up(t)) {
+            // undo
+            looper.set_undo_mode(true);
+            reset_button(t);
+        }
+    }
+
+    if (state == TEMP_RECORD) {
+        bool done = looper.scratch_buffer_size >= SCRATCH_BUFFER_SIZE;
+        if (!button_pressed && !button_released && done) {
+            // invalidate tmp buffer
+            looper.set_undo_mode(!looper.undo_mode);
+            update_state(t, PLAY);
+        } else if (button_pressed && button_released && !done) {
+            // invalidate tmp buffer
+            update_state(t, STOPPED);
+        } else if (done) {
+            update_state(t, RECORD);
+        }
+    }
+
+    if (state == STOPPED) {
+        if (start_when_in_phase(t)) {
+            update_state(t, PLAYBACK1);
+        } else if (!button_released && time_up(t)) {
+            update_state(t, IDLE);
+        }
+    }
+
+    if (state == PLAYBACK1) {
+        if (button_released && button_pressed && !time_up(t)) {
+            update_state(t, STOPPED);
+        } else if (!button_released && time_up(t)) {
+            update_state(t, IDLE);
+        } else if (button_released && button_pressed /*&& time_up(t) implied*/) {
+            update_state(t, TEMP_RECORD);
+        }
+    }
+
+    if (state != IDLE && state != STOPPED && state != FIRST_STOP && looper.prefetch.block_rate != PLAYBACK_RATE_UNITY) {
+        return get_next_sample_varispeed(t);
+    }
+
+    // old code below
+    // add the current and looped values together, then write back
+    uint index = 0;
+    if (state != IDLE && state != STOPPED && state != FIRST_STOP) {
+        index = looper.buffer_offset[LOOP_BUFFER]++;
+    }
+
+    if (state == IDLE || state == STOPPED || state == FIRST_STOP) { 
+        return 0; // we're done
+    }
+
+    // nothing is written into a block that is being repeated. Old active regions are committed as
+    // they are played, which makes every block dirty, so that waits after an overrun too (unless
+    // the active layer is being recorded over, or about to be). Whether a block commits is decided
+    // at its start, so each block is committed in one go and can be marked done at its end
+    bool write = !looper.fallback;
+    if (index == 0) {
+        plan_gains(t);
+        bool overdubbing = state == RECORD || state == TEMP_RECORD || state == FIRST_TMP_RECORD;
+        looper.commit_block = write && (looper.overload == 0 || overdubbing);
+        looper.commit_regions = looper.commit_block ? looper.old_active_start.size() : 0;
+    }
+    int32_t main_gain = t.gain[MAIN_SAMPLE].envelope.tick();
+    int32_t active_gain = t.gain[ACTIVE_SAMPLE].envelope.tick();
+    int32_t old_fade = t.old_region_fade.tick();
+
+    bool commit = looper.commit_block;
+    int32_t old_gain; // an old active region plays, and is committed, at the gain it kept
+    bool in_old_active_region = looper.in_old_active_region(&old_gain);
+    if (in_old_active_region) active_gain = old_gain * old_fade >> GAIN_SHIFT;
+    int16_t main = looper.buffer[LOOP_BUFFER][index][MAIN_SAMPLE];
+    int16_t active = looper.buffer[LOOP_BUFFER][index][ACTIVE_SAMPLE];
+
+    // in the active region, the active sample is mixed in too. In the first record state there's no main sample yet
+    bool play_active = (!looper.undo_mode && looper.in_active_region()) || in_old_active_region; // TODO: check this line more carefully
+    int16_t mixed = mix_layers(state != FIRST_RECORD ? main : 0, active, main_gain, play_active ? active_gain : 0);
+    if (looper.fallback && !OVERRUN_REPEAT) {
+        mixed = 0;
+    }
+    mixed = fade_output(looper, mixed);
+    if (state != FIRST_RECORD) looper_ctx->level_meters.add(METER_TRACK(t.id, MAIN_SAMPLE), main);
+    if (play_active) looper_ctx->level_meters.add(METER_TRACK(t.id, ACTIVE_SAMPLE), active);
+    looper_ctx->level_meters.add(METER_TRACK(t.id, METER_MIX), mixed);
+
+    // TODO: hasn't been verified yet
+    if (looper.active_size == looper.loop_length && write) {
+        looper.buffer[LOOP_BUFFER][index][ACTIVE_SAMPLE] = add(active, current);
+        looper.dirty[LOOP_BUFFER] = true;
+    }
+
+    if (in_old_active_region && commit) {
+        // we need to write the old active region, at the level it was playing at (without the edge fades)
+        looper.buffer[LOOP_BUFFER][index][MAIN_SAMPLE] = commit_layers(main, active, old_gain);
+        looper.dirty[LOOP_BUFFER] = true;
+    }
+
+    if (state == RECORD && write) {
+        looper.buffer[LOOP_BUFFER][index][ACTIVE_SAMPLE] = current;
+        looper.dirty[LOOP_BUFFER] = true;
+    } else if (state == FIRST_RECORD && write) {
+        looper.buffer[LOOP_BUFFER][index][MAIN_SAMPLE] = current;
+        looper.dirty[LOOP_BUFFER] = true;
+    }
+
+    if (state == TEMP_RECORD || state == FIRST_TMP_RECORD) {
+        looper.scratch_buffer[looper.scratch_buffer_size] = current;
+        looper.scratch_buffer_size++;
+    }
+
+    // now increment time and length
+    looper.loop_time++;
+    if (state == FIRST_RECORD) looper.loop_length++;
+
+    if (state == RECORD) {
+        if (looper.active_size < looper.loop_length) looper.active_size++;
+    }
+
+    if (looper.buffer_offset[LOOP_BUFFER] >= BUFFER_SIZE) {
+        // the old active regions that were there all through the block are committed in it now
+        if (looper.commit_regions > 0) {
+            looper.old_block_committed(looper.buffer_start[LOOP_BUFFER] % looper.loop_length / BUFFER_SIZE, looper.commit_regions);
+            looper.commit_regions = 0;
+        }
+        looper.erase_committed_old_regions();
+
+        // we're out of bounds, so we need to swap buffers
+        if (looper.overload > 0) looper.overload--;
+        if (t.signal_write || looper.fallback) {
+            // the other buffer isn't ready yet
+            missed_block(t);
+        } else if (state == FIRST_RECORD) {
+            // special hack for first reads
+            looper.which = !looper.which; // swap buffers. The other buffer must contain the next audio to be played
+            looper.buffer_start[LOOP_BUFFER] = looper.buffer_start[PSRAM_ACCESS_BUFFER] + BUFFER_SIZE;
+            t.read_location = 0; // always read from 0 for first_record. It comes from the loop head, so closing the loop never waits for it
+            signal_prefetch(t);
+        } else if (looper.buffer_start[PSRAM_ACCESS_BUFFER] != prefetch_t::next_block(looper.buffer_start[LOOP_BUFFER], looper.loop_length, PLAYBACK_RATE_UNITY)) {
+            // the refill went out for another location: the first recording was closed while it was on its way
+            missed_block(t);
+        } else {
+            end_of_block(t);
+            signal_prefetch(t);
+        }
+    }
+
+    if (looper.loop_time >= looper.loop_length) {
+        looper.loop_time = 0;
+    }
+
+    return mixed;
+}
+
+// the master's loop position for the sample about to be played, or -1 if it isn't moving through its loop at 1x
+static int master_position() {
+    track_t& master = MASTER_TRACK;
+    state_t state = master.state;
+    bool running = state != IDLE && state != STOPPED && state != FIRST_STOP && state != FIRST_RECORD && !master.loading;
+    if (!running || master.looper.prefetch.block_rate != PLAYBACK_RATE_UNITY) return -1;
+    return master.looper.loop_time;
+}
+
+int16_t get_next_sample(int16_t current) {
+    looper_context_t& ctx = *looper_ctx;
+    ctx.master_time = master_position(); // before the master moves on, so every track sees the same sample
+    // summed at full width and saturated once, so clipping shows up in the output meter
+    int32_t sum = current;
+    for (track_t& t : ctx.tracks) {
+        sum += track_next_sample(t, current);
+    }
+    int16_t mixed = saturate16(sum);
+    ctx.level_meters.add(METER_INPUT, current);
+    ctx.level_meters.add(METER_OUTPUT, mixed);
+
+    ctx.block_clock++;
+    if (ctx.block_clock >= BUFFER_SIZE) {
+        ctx.block_clock = 0;
+        ctx.level_meters.end_block(BUFFER_SIZE);
+    }
+    return mixed;
+}
+
+/**
+ * Background PSRAM work (flash store, USB transfers) gets one chunk right after each refill burst,
+ * or any time when no track is streaming, so it never delays a refill.
+*/
+bool take_psram_window() {
+    bool any_streaming = false;
+    bool overloaded = false; // a track has had a refill overrun recently, so background work waits
+    looper_context_t& ctx = *looper_ctx;
+    for (track_t& t : ctx.tracks) {
+        any_streaming |= is_streaming(t);
+        overloaded |= is_streaming(t) && t.looper.overload > 0;
+    }
+    if (ctx.signal_write || overloaded || (any_streaming && !ctx.psram_window)) return false;
+    ctx.psram_window = false;
+    return true;
+}
+
+// a new loop is in PSRAM: prime both staging buffers and leave the track stopped at the loop start
+void start_stopped(track_t& t) {
+    looper_t& looper = t.looper;
+    looper.loop_time = 0;
+
+    looper.buffer_start[LOOP_BUFFER] = 0;
+    looper.buffer_offset[LOOP_BUFFER] = 0;
+    psram_transfer(t, 0, looper.buffer[LOOP_BUFFER], BUFFER_SIZE, false);
+    looper.buffer_start[PSRAM_ACCESS_BUFFER] = prefetch_t::next_block(0, looper.loop_length, PLAYBACK_RATE_UNITY);
+    looper.buffer_offset[PSRAM_ACCESS_BUFFER] = 0;
+    psram_transfer(t, looper.buffer_start[PSRAM_ACCESS_BUFFER], looper.buffer[PSRAM_ACCESS_BUFFER], BUFFER_SIZE, false);
+    looper.dirty[0] = false;
+    looper.dirty[1] = false;
+
+    update_state(t, STOPPED);
+    t.loading = false;
+}
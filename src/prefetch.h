@@ -0,0 +1,95 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Playback rates are Q8 fixed point: 256 is 1x forward, -256 is 1x reverse, 128 is half speed
+#define PLAYBACK_RATE_UNITY 256
+#define PLAYBACK_RATE_MIN (PLAYBACK_RATE_UNITY / 4)
+#define PLAYBACK_RATE_MAX (PLAYBACK_RATE_UNITY * 2) // each block is refilled twice as often at 2x
+
+/**
+ * One contiguous PSRAM transfer. `start` is the loop position (in samples) and `offset` is
+ * where the transfer begins inside the staging buffer.
+*/
+struct psram_span_t {
+    uint start;
+    uint offset;
+    uint size;
+};
+
+/**
+ * Split a transfer of `size` samples beginning at loop position `start` so that it wraps at the
+ * loop end. Returns the number of spans filled in (1 or 2).
+*/
+inline uint split_block(uint start, uint size, uint loop_length, psram_span_t spans[2]) {
+    if (loop_length == 0 || start + size <= loop_length) {
+        spans[0] = {start, 0, size};
+        return 1;
+    }
+    start %= loop_length;
+    uint size_one = loop_length - start;
+    if (size_one >= size) {
+        spans[0] = {start, 0, size};
+        return 1;
+    }
+    spans[0] = {start, 0, size_one};
+    spans[1] = {0, size_one, size - size_one};
+    return 2;
+}
+
+/**
+ * Tracks the playback direction and rate, and decides which PSRAM block has to be fetched next.
+ * Rate changes only take effect at block boundaries, since the block being prefetched depends
+ * on the direction the loop is being played in.
+*/
+struct prefetch_t {
+    int rate = PLAYBACK_RATE_UNITY;       // requested rate
+    int block_rate = PLAYBACK_RATE_UNITY; // rate of the block that is currently being played
+    uint phase = 0;                       // Q8 position inside the current block
+
+    static constexpr uint BLOCK_PHASE = BUFFER_SIZE * PLAYBACK_RATE_UNITY;
+
+    inline void set_rate(int new_rate) {
+        int magnitude = abs(new_rate);
+        if (magnitude < PLAYBACK_RATE_MIN) magnitude = PLAYBACK_RATE_MIN;
+        if (magnitude > PLAYBACK_RATE_MAX) magnitude = PLAYBACK_RATE_MAX;
+        rate = new_rate < 0 ? -magnitude : magnitude;
+    }
+
+    inline bool reverse() const {
+        return block_rate < 0;
+    }
+
+    // index into the current block for the sample at the current phase
+    inline uint index() const {
+        uint i = phase / PLAYBACK_RATE_UNITY;
+        return reverse() ? BUFFER_SIZE - 1 - i : i;
+    }
+
+    // advance by one output sample. Returns true when the current block has been used up.
+    inline bool advance() {
+        phase += abs(block_rate);
+        if (phase >= BLOCK_PHASE) {
+            phase -= BLOCK_PHASE;
+            return true;
+        }
+        return false;
+    }
+
+    // the block that has to be played after the one at `block_start`, for the given rate
+    static inline uint next_block(uint block_start, uint loop_length, int rate) {
+        if (rate < 0) {
+            return (block_start + loop_length - BUFFER_SIZE) % loop_length;
+        }
+        return (block_start + BUFFER_SIZE) % loop_length;
+    }
+
+    // true when switching to `new_rate` means turning around inside the current block
+    inline bool changes_direction(int new_rate) const {
+        return (new_rate < 0) != (block_rate < 0);
+    }
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef SILENCE_MAP_H
+#define SILENCE_MAP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Which PSRAM blocks of a track hold nothing but silence, in both layers. Blocks are BUFFER_SIZE
+ * samples, counted from the start of the track's partition. A silent block is never transferred:
+ * reads of it are zero filled, and whatever PSRAM still holds there is stale. Everything starts out
+ * silent, so a new loop never plays back what an old one left in PSRAM.
+ */
+
+#define SILENCE_THRESHOLD 0 // samples with a magnitude up to this count as silence. Raise it to gate the input noise floor
+#define SILENCE_MAP_BLOCKS (PSRAM_TRACK_SAMPLES / BUFFER_SIZE)
+
+struct silence_map_t {
+    uint32_t silent[(SILENCE_MAP_BLOCKS + 31) / 32];
+
+    silence_map_t() {
+        reset();
+    }
+
+    inline void reset() {
+        memset(silent, 0xff, sizeof(silent));
+    }
+
+    inline bool is_silent(uint block) const {
+        return silent[block / 32] & (1u << (block % 32));
+    }
+
+    inline void mark(uint block, bool is_silent) {
+        if (is_silent) {
+            silent[block / 32] |= 1u << (block % 32);
+        } else {
+            silent[block / 32] &= ~(1u << (block % 32));
+        }
+    }
+
+    // true if `size` samples of both layers would be stored as silence
+    static bool is_quiet(const int16_t (*data)[2], uint size) {
+        for (uint i = 0; i < size; i++) {
+            if (abs(data[i][0]) > SILENCE_THRESHOLD || abs(data[i][1]) > SILENCE_THRESHOLD) return false;
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,64 @@
+#include "hardware/clocks.h"
+#include "hardware/pio.h"
+#include "hardware/sync.h"
+#include "pico/stdlib.h"
+
+#include "i2s.h"
+#include "sys_clock.h"
+
+static pio_i2s* i2s_p = nullptr;
+static uint32_t full_hz;
+static uint32_t idle_div = 1; // 1 if there is no idle clock
+static pio_i2s_clocks full_clocks;
+static pio_i2s_clocks idle_clocks;
+static volatile bool idle = false;
+
+void sys_clock_init(pio_i2s* i2s, const i2s_config* config) {
+    i2s_p = i2s;
+    full_hz = clock_get_hz(clk_sys);
+    i2s_calc_clocks(full_hz, config->fs, config->sck_mult, config->bit_depth, &full_clocks);
+#if SYS_CLOCK_SCALING
+    idle_div = sys_clock_idle_divider(full_hz, SYS_CLOCK_IDLE_MIN_HZ, config->fs, config->sck_mult, config->bit_depth, &idle_clocks);
+#endif
+    if (idle_div == 1) {
+        printf("No idle clock keeps the I2S dividers exact, staying at %d Hz\n", full_hz);
+    } else {
+        printf("Idle clock: %d Hz (clk_sys divider %d)\n", full_hz / idle_div, idle_div);
+    }
+}
+
+/**
+ * The I2S state machines are paused for the switch and restarted with their dividers in sync, so
+ * SCK, BCK and LRCK come back locked to each other and no bit is dropped. All register writes
+ * happen at the faster of the two clocks, which keeps the pause short (see host/clock_plan.cpp).
+ * Called with interrupts off: nothing may run with the PIO and clk_sys out of step.
+*/
+static void switch_clock(uint32_t div, const pio_i2s_clocks* clocks) {
+    pio_set_sm_mask_enabled(i2s_p->pio, i2s_p->sm_mask, false);
+    if (div == 1) {
+        clocks_hw->clk[clk_sys].div = div << CLOCKS_CLK_SYS_DIV_INT_LSB;
+        i2s_set_clkdivs(i2s_p, clocks);
+    } else {
+        i2s_set_clkdivs(i2s_p, clocks);
+        clocks_hw->clk[clk_sys].div = div << CLOCKS_CLK_SYS_DIV_INT_LSB;
+    }
+    pio_enable_sm_mask_in_sync(i2s_p->pio, i2s_p->sm_mask);
+    idle = div != 1;
+}
+
+void sys_clock_full() {
+    uint32_t saved = save_and_disable_interrupts();
+    if (idle) switch_clock(1, &full_clocks);
+    restore_interrupts(saved);
+}
+
+void sys_clock_idle() {
+    uint32_t saved = save_and_disable_interrupts();
+    if (!idle && idle_div != 1) switch_clock(idle_div, &idle_clocks);
+    restore_interrupts(saved);
+}
+
+// clock_get_hz() keeps reporting the full clock: the SDK only learns about clocks it configured itself
+uint32_t sys_clock_hz() {
+    return idle ? full_hz / idle_div : full_hz;
+}
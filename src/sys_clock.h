@@ -0,0 +1,62 @@
+#ifndef SYS_CLOCK_H
+#define SYS_CLOCK_H
+
+#include <stdint.h>
+
+#include "i2s_clocks.h"
+
+/*
+ * Dynamic system clock scaling. While no track is streaming (IDLE, STOPPED, FIRST_STOP) and no
+ * background job is using PSRAM, clk_sys runs from its own integer divider at the lowest clock
+ * where the I2S dividers are still exact, so the sample rate doesn't move. The PLL is left alone:
+ * relocking it means running clk_sys from clk_ref for the lock time, which stops the I2S.
+ *
+ * A switch pauses the I2S state machines, changes clk_sys and the PIO dividers, and restarts them
+ * in sync, all with interrupts off. The clocks to the codec stretch by well under a sample and no
+ * bits are lost; BCK can end up a few SCK cycles (less than half a BCK cycle) from where it was
+ * against SCK, but stays locked to it. host/clock_plan.cpp works through the candidate clocks and
+ * the switch sequence.
+ *
+ * clk_peri runs from clk_sys, so the PSRAM SPI slows down by the same factor. That's why the clock
+ * only drops when PSRAM is idle, and goes back up on the footswitch press that starts recording,
+ * before the looper sees it. It also stays up while a USB host is, or may be, attached: from boot
+ * (or VBUS coming up, where the board senses it) until the device is configured, and while it is.
+ * TinyUSB and the serial console haven't been checked at the idle clock, so enumeration never runs
+ * there and the clock only drops when the pedal is on a power supply.
+ */
+
+#define SYS_CLOCK_SCALING 1              // 0 keeps clk_sys at full speed all the time
+#define SYS_CLOCK_MAX_DIV 16             // largest clk_sys divider the idle clock search tries
+#define SYS_CLOCK_IDLE_MIN_HZ 24000000   // lowest idle clock: the audio ISR and button sampling still need cycles
+#define SYS_CLOCK_IDLE_DELAY_US 1000000  // how long the looper has to be idle before the clock drops
+#define SYS_CLOCK_USB_WAIT_US 5000000    // how long a host gets to configure the device (after boot, VBUS or unmount)
+
+/**
+ * The largest integer clk_sys divider (up to SYS_CLOCK_MAX_DIV) that takes `full_hz` down to a
+ * clock of at least `min_hz` where the I2S dividers are still exact, or 1 if there isn't one.
+ * `clocks` gets the dividers for that clock.
+*/
+inline uint32_t sys_clock_idle_divider(uint32_t full_hz, uint32_t min_hz, uint32_t fs, uint32_t sck_mult, uint8_t bit_depth, pio_i2s_clocks* clocks) {
+    for (uint32_t div = SYS_CLOCK_MAX_DIV; div > 1; div--) {
+        uint32_t hz = full_hz / div;
+        if (full_hz % div != 0 || hz < min_hz) continue;
+        i2s_calc_clocks(hz, fs, sck_mult, bit_depth, clocks);
+        if (i2s_clocks_exact(hz, fs, sck_mult, bit_depth, clocks)) return div;
+    }
+    i2s_calc_clocks(full_hz, fs, sck_mult, bit_depth, clocks);
+    return 1;
+}
+
+struct pio_i2s;
+struct i2s_config;
+
+// work out the idle clock for the running I2S. Call after the I2S has started at the full clock
+void sys_clock_init(pio_i2s* i2s, const i2s_config* config);
+// back to the full clock. Safe to call from any IRQ, and cheap if the clock is already up
+void sys_clock_full();
+// down to the idle clock, if there is one. The caller makes sure PSRAM is idle, with interrupts
+// off so a footswitch press can't slip in between the check and the switch
+void sys_clock_idle();
+uint32_t sys_clock_hz();
+
+#endif
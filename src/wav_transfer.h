@@ -0,0 +1,276 @@
+#ifndef WAV_TRANSFER_H
+#define WAV_TRANSFER_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * WAV export/import of a loop over USB CDC.
+ *
+ * A loop is exported as a 2 channel, 16 bit WAV with the main layer on the left and the active
+ * layer on the right, which is byte for byte the layout PSRAM already uses. So an export is just
+ * a WAV header followed by PSRAM blocks, each read into `block` and written straight out.
+ *
+ * An import takes a canonical 44 byte WAV header (16 bit PCM, 1 or 2 channels, at the looper's
+ * sample rate) and the sample data. Each block is converted in place (mono goes to the main
+ * layer, stereo is folded into it) and written straight to PSRAM.
+ *
+ * Protocol, after the command character on the serial port. Every reply from the device is framed
+ * (WAV_REPLY_MARK and a code), so console text that was printed before it can't be mistaken for one:
+ *   export: the device answers 'A' (accepted) and sends the header and data, or 'N' (rejected)
+ *   import: the device answers 'A' if the track can take a loop, or 'N'. The host sends the header,
+ *           the device answers 'A' or 'N' again, the host sends the data and the device answers
+ *           'D' once it is all in PSRAM
+ *
+ * A transfer that makes no progress for WAV_TIMEOUT_US is given up on, so a host that goes away in
+ * the middle of one doesn't leave the device waiting for it forever.
+ *
+ * Like flash_store.h this only does the bookkeeping, so it can run on the host (host/wav_client.cpp).
+ */
+
+#define WAV_HEADER_SIZE 44
+#define WAV_BLOCK_SAMPLES 256 // one PSRAM block
+#define WAV_SAMPLE_RATE 48000
+#define WAV_TIMEOUT_US 2000000
+
+#define WAV_REPLY_MARK "\x02" "WAV" // STX never shows up in console text
+#define WAV_REPLY_MARK_SIZE 4
+#define WAV_REPLY_SIZE (WAV_REPLY_MARK_SIZE + 1)
+#define WAV_ACCEPTED 'A'
+#define WAV_REJECTED 'N'
+#define WAV_DONE 'D'
+
+struct wav_format_t {
+    uint16_t channels;
+    uint16_t bits;
+    uint32_t sample_rate;
+    uint32_t data_size; // bytes
+};
+
+inline void wav_put16(uint8_t* p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+inline void wav_put32(uint8_t* p, uint32_t v) { wav_put16(p, v); wav_put16(p + 2, v >> 16); }
+inline uint16_t wav_get16(const uint8_t* p) { return p[0] | (p[1] << 8); }
+inline uint32_t wav_get32(const uint8_t* p) { return wav_get16(p) | ((uint32_t) wav_get16(p + 2) << 16); }
+
+inline void wav_write_header(uint8_t* out, const wav_format_t& format) {
+    uint16_t block_align = format.channels * format.bits / 8;
+    memcpy(out, "RIFF", 4);
+    wav_put32(out + 4, 36 + format.data_size);
+    memcpy(out + 8, "WAVEfmt ", 8);
+    wav_put32(out + 16, 16);
+    wav_put16(out + 20, 1); // PCM
+    wav_put16(out + 22, format.channels);
+    wav_put32(out + 24, format.sample_rate);
+    wav_put32(out + 28, format.sample_rate * block_align);
+    wav_put16(out + 32, block_align);
+    wav_put16(out + 34, format.bits);
+    memcpy(out + 36, "data", 4);
+    wav_put32(out + 40, format.data_size);
+}
+
+inline void wav_write_reply(uint8_t* out, uint8_t code) {
+    memcpy(out, WAV_REPLY_MARK, WAV_REPLY_MARK_SIZE);
+    out[WAV_REPLY_MARK_SIZE] = code;
+}
+
+// parse a canonical 44 byte header. Returns false if it isn't one
+inline bool wav_parse_header(const uint8_t* in, wav_format_t* format) {
+    if (memcmp(in, "RIFF", 4) || memcmp(in + 8, "WAVEfmt ", 8) || memcmp(in + 36, "data", 4)) return false;
+    if (wav_get32(in + 16) != 16 || wav_get16(in + 20) != 1) return false;
+    format->channels = wav_get16(in + 22);
+    format->sample_rate = wav_get32(in + 24);
+    format->bits = wav_get16(in + 34);
+    format->data_size = wav_get32(in + 40);
+    return true;
+}
+
+enum wav_job_t { WAV_JOB_NONE, WAV_JOB_EXPORT, WAV_JOB_IMPORT };
+
+struct wav_transfer_t {
+    wav_job_t job = WAV_JOB_NONE;
+    uint32_t track = 0;
+    uint32_t loop_length = 0; // samples to export, or samples being imported
+    uint32_t max_samples = 0; // how much an import may write
+    uint32_t progress = 0;    // samples moved between PSRAM and `block` so far
+    bool ok = false;          // set when an import made it into PSRAM in one piece
+
+    int16_t block[WAV_BLOCK_SAMPLES][2]; // the staging block
+    uint8_t header[WAV_HEADER_SIZE]; // an import's header, as it comes in
+    wav_format_t format;
+    uint8_t reply[WAV_REPLY_SIZE + WAV_HEADER_SIZE]; // the last reply. An export's header goes out right after it
+    uint64_t last_progress_us = 0;                   // 0 until the first poll
+
+    // bytes waiting to go out over USB
+    const uint8_t* out = nullptr;
+    uint32_t out_size = 0;
+    // bytes expected from USB
+    uint32_t in_fill = 0;     // bytes received into the current header/block
+    uint32_t block_samples = 0;
+    bool block_full = false;  // waiting for the PSRAM write
+    bool header_done = false;
+
+    inline bool busy() const {
+        return job != WAV_JOB_NONE;
+    }
+
+    bool begin_export(uint32_t track_id, uint32_t samples) {
+        if (busy() || samples == 0) return false;
+        job = WAV_JOB_EXPORT;
+        track = track_id;
+        loop_length = samples;
+        progress = 0;
+        last_progress_us = 0;
+
+        format = {2, 16, WAV_SAMPLE_RATE, samples * 4};
+        send_reply(WAV_ACCEPTED);
+        wav_write_header(reply + WAV_REPLY_SIZE, format);
+        out_size += WAV_HEADER_SIZE;
+        return true;
+    }
+
+    // the next range of samples to read from PSRAM into `block`, or 0 if it isn't time yet
+    uint32_t next_export_read(uint32_t* start) const {
+        if (job != WAV_JOB_EXPORT || out_size > 0 || progress >= loop_length) return 0;
+        uint32_t count = loop_length - progress;
+        if (count > WAV_BLOCK_SAMPLES) count = WAV_BLOCK_SAMPLES;
+        *start = progress;
+        return count;
+    }
+
+    void export_read_done(uint32_t count) {
+        progress += count;
+        out = (const uint8_t*) block;
+        out_size = count * 4;
+    }
+
+    // bytes that should go out over USB, if any
+    const uint8_t* pending_output(uint32_t* size) const {
+        *size = out_size;
+        return out;
+    }
+
+    void output_sent(uint32_t size) {
+        out += size;
+        out_size -= size;
+        if (out_size > 0) return;
+        bool export_done = job == WAV_JOB_EXPORT && progress >= loop_length;
+        uint8_t code = reply[WAV_REPLY_MARK_SIZE];
+        bool import_done = job == WAV_JOB_IMPORT && (code == WAV_REJECTED || code == WAV_DONE);
+        if (export_done || import_done) job = WAV_JOB_NONE;
+    }
+
+    bool begin_import(uint32_t track_id, uint32_t max) {
+        if (busy()) return false;
+        job = WAV_JOB_IMPORT;
+        track = track_id;
+        max_samples = max;
+        progress = 0;
+        loop_length = 0;
+        in_fill = 0;
+        header_done = false;
+        block_full = false;
+        ok = false;
+        last_progress_us = 0;
+        send_reply(WAV_ACCEPTED); // ready for the header
+        return true;
+    }
+
+    // where bytes from USB should go, and how many can be taken right now
+    uint8_t* input_dest(uint32_t* room) {
+        *room = 0;
+        if (job != WAV_JOB_IMPORT || block_full || out_size > 0) return nullptr;
+        if (!header_done) {
+            *room = WAV_HEADER_SIZE - in_fill;
+            return header + in_fill;
+        }
+        if (progress >= loop_length) return nullptr;
+        uint32_t frame = format.channels * 2;
+        uint32_t left = (loop_length - progress) * frame;
+        uint32_t block_bytes = WAV_BLOCK_SAMPLES * frame;
+        if (left > block_bytes) left = block_bytes;
+        *room = left - in_fill;
+        return (uint8_t*) block + in_fill;
+    }
+
+    void input_received(uint32_t size) {
+        in_fill += size;
+        if (!header_done) {
+            if (in_fill < WAV_HEADER_SIZE) return;
+            in_fill = 0;
+            header_done = true;
+            bool accepted = wav_parse_header(header, &format) && format.bits == 16
+                && (format.channels == 1 || format.channels == 2) && format.sample_rate == WAV_SAMPLE_RATE;
+            loop_length = accepted ? format.data_size / (format.channels * 2) : 0;
+            if (loop_length == 0 || loop_length > max_samples) accepted = false;
+            send_reply(accepted ? WAV_ACCEPTED : WAV_REJECTED);
+            return;
+        }
+
+        uint32_t frame = format.channels * 2;
+        uint32_t left = loop_length - progress;
+        uint32_t expected = (left < WAV_BLOCK_SAMPLES ? left : WAV_BLOCK_SAMPLES) * frame;
+        if (in_fill < expected) return;
+
+        // convert to the main/active layout in place
+        block_samples = expected / frame;
+        if (format.channels == 1) {
+            int16_t* mono = (int16_t*) block;
+            for (int i = block_samples - 1; i >= 0; i--) {
+                block[i][0] = mono[i];
+                block[i][1] = 0;
+            }
+        } else {
+            for (uint32_t i = 0; i < block_samples; i++) {
+                int32_t folded = block[i][0] + block[i][1];
+                if (folded > INT16_MAX) folded = INT16_MAX;
+                if (folded < INT16_MIN) folded = INT16_MIN;
+                block[i][0] = folded;
+                block[i][1] = 0;
+            }
+        }
+        block_full = true;
+        in_fill = 0;
+    }
+
+    // the range of samples in `block` that should be written to PSRAM, or 0 if there are none yet
+    uint32_t next_import_write(uint32_t* start) const {
+        if (job != WAV_JOB_IMPORT || !block_full) return 0;
+        *start = progress;
+        return block_samples;
+    }
+
+    void import_write_done(uint32_t count) {
+        progress += count;
+        block_full = false;
+        if (progress >= loop_length) {
+            ok = true;
+            send_reply(WAV_DONE);
+        }
+    }
+
+    void send_reply(uint8_t code) {
+        wav_write_reply(reply, code);
+        out = reply;
+        out_size = WAV_REPLY_SIZE;
+    }
+
+    /**
+     * Called on every poll, with whether any bytes or samples moved since the last one. Returns
+     * true once nothing has for WAV_TIMEOUT_US: the host has gone away, and the transfer should
+     * be aborted.
+    */
+    bool stalled(uint64_t now_us, bool moved) {
+        if (moved || last_progress_us == 0) last_progress_us = now_us;
+        return now_us - last_progress_us > WAV_TIMEOUT_US;
+    }
+
+    // give up on the transfer. An import that is aborted isn't ok, so nothing of it is kept
+    void abort() {
+        job = WAV_JOB_NONE;
+        ok = false;
+        out_size = 0;
+        block_full = false;
+    }
+};
+
+#endif